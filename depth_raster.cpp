@@ -0,0 +1,250 @@
+/* This file is part of PlasmaView.
+ *
+ * PlasmaView is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PlasmaView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Gneral Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PlasmaView.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "depth_raster.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#   include <emmintrin.h>
+#   define DEPTH_RASTER_SSE2
+#endif
+
+// Boxes must be at least this much closer than the occluder to be rejected
+static const float s_depthBias = 1.0e-3f;
+
+namespace
+{
+    struct ClipVert
+    {
+        float x, y, z, w;
+    };
+
+    ClipVert transform(const float *m, const float *p)
+    {
+        ClipVert v;
+        v.x = m[0] * p[0] + m[4] * p[1] + m[8] * p[2] + m[12];
+        v.y = m[1] * p[0] + m[5] * p[1] + m[9] * p[2] + m[13];
+        v.z = m[2] * p[0] + m[6] * p[1] + m[10] * p[2] + m[14];
+        v.w = m[3] * p[0] + m[7] * p[1] + m[11] * p[2] + m[15];
+        return v;
+    }
+
+    ClipVert lerp(const ClipVert &a, const ClipVert &b, float t)
+    {
+        ClipVert v;
+        v.x = a.x + (b.x - a.x) * t;
+        v.y = a.y + (b.y - a.y) * t;
+        v.z = a.z + (b.z - a.z) * t;
+        v.w = a.w + (b.w - a.w) * t;
+        return v;
+    }
+
+    void emitTriangle(const ClipVert &a, const ClipVert &b, const ClipVert &c,
+                      std::vector<DepthRaster::ScreenTri> &out)
+    {
+        const ClipVert *verts[3] = { &a, &b, &c };
+        DepthRaster::ScreenTri tri;
+        for (int k = 0; k < 3; ++k) {
+            float invW = 1.0f / verts[k]->w;
+            tri.x[k] = (verts[k]->x * invW * 0.5f + 0.5f) * DepthRaster::Width;
+            tri.y[k] = (verts[k]->y * invW * 0.5f + 0.5f) * DepthRaster::Height;
+            tri.invW[k] = invW;
+        }
+
+        // Counter-clockwise is front facing, as in GL; back faces are
+        // culled when drawing, so they can't hide anything either.
+        float area = (tri.x[1] - tri.x[0]) * (tri.y[2] - tri.y[0])
+                   - (tri.x[2] - tri.x[0]) * (tri.y[1] - tri.y[0]);
+        if (area > 0.0f)
+            out.push_back(tri);
+    }
+}
+
+void DepthRaster::setupTriangles(const float *clip, const float *positions,
+                                 size_t triCount, std::vector<ScreenTri> &out)
+{
+    for (size_t t = 0; t < triCount; ++t) {
+        ClipVert in[3];
+        for (int k = 0; k < 3; ++k)
+            in[k] = transform(clip, positions + t * 9 + k * 3);
+
+        // Trivially reject anything entirely outside one frustum plane
+        if ((in[0].x < -in[0].w && in[1].x < -in[1].w && in[2].x < -in[2].w)
+                || (in[0].x > in[0].w && in[1].x > in[1].w && in[2].x > in[2].w)
+                || (in[0].y < -in[0].w && in[1].y < -in[1].w && in[2].y < -in[2].w)
+                || (in[0].y > in[0].w && in[1].y > in[1].w && in[2].y > in[2].w)
+                || (in[0].z > in[0].w && in[1].z > in[1].w && in[2].z > in[2].w))
+            continue;
+
+        // Clip against the near plane (z >= -w)
+        ClipVert poly[4];
+        int count = 0;
+        for (int k = 0; k < 3; ++k) {
+            const ClipVert &cur = in[k];
+            const ClipVert &next = in[(k + 1) % 3];
+            float dCur = cur.z + cur.w, dNext = next.z + next.w;
+            if (dCur >= 0.0f)
+                poly[count++] = cur;
+            if ((dCur >= 0.0f) != (dNext >= 0.0f))
+                poly[count++] = lerp(cur, next, dCur / (dCur - dNext));
+        }
+
+        for (int k = 2; k < count; ++k) {
+            if (poly[0].w > 0.0f && poly[k - 1].w > 0.0f && poly[k].w > 0.0f)
+                emitTriangle(poly[0], poly[k - 1], poly[k], out);
+        }
+    }
+}
+
+bool DepthRaster::projectBox(const float *clip, const float *boxMin,
+                             const float *boxMax, ScreenRect &rect)
+{
+    float minX = Width, minY = Height, maxX = 0.0f, maxY = 0.0f;
+    float nearest = 0.0f;
+    for (int corner = 0; corner < 8; ++corner) {
+        float p[3] = {
+            (corner & 1) ? boxMax[0] : boxMin[0],
+            (corner & 2) ? boxMax[1] : boxMin[1],
+            (corner & 4) ? boxMax[2] : boxMin[2],
+        };
+        ClipVert v = transform(clip, p);
+        if (v.z < -v.w || v.w <= 0.0f)
+            return false;
+
+        float invW = 1.0f / v.w;
+        float sx = (v.x * invW * 0.5f + 0.5f) * Width;
+        float sy = (v.y * invW * 0.5f + 0.5f) * Height;
+        minX = std::min(minX, sx);
+        maxX = std::max(maxX, sx);
+        minY = std::min(minY, sy);
+        maxY = std::max(maxY, sy);
+        nearest = std::max(nearest, invW);
+    }
+
+    rect.x0 = std::max(0, int(std::floor(minX)));
+    rect.y0 = std::max(0, int(std::floor(minY)));
+    rect.x1 = std::min(int(Width), int(std::ceil(maxX)));
+    rect.y1 = std::min(int(Height), int(std::ceil(maxY)));
+    rect.nearestInvW = nearest;
+    return true;
+}
+
+void DepthRaster::clear(int y0, int y1)
+{
+    std::fill(m_depth.begin() + y0 * Width, m_depth.begin() + y1 * Width, 0.0f);
+}
+
+void DepthRaster::rasterize(const std::vector<ScreenTri> &tris, int y0, int y1)
+{
+    for (const ScreenTri &tri : tris) {
+        float minX = std::min(tri.x[0], std::min(tri.x[1], tri.x[2]));
+        float maxX = std::max(tri.x[0], std::max(tri.x[1], tri.x[2]));
+        float minY = std::min(tri.y[0], std::min(tri.y[1], tri.y[2]));
+        float maxY = std::max(tri.y[0], std::max(tri.y[1], tri.y[2]));
+
+        int px0 = std::max(0, int(std::floor(minX))) & ~3;
+        int px1 = std::min(int(Width), int(std::ceil(maxX)));
+        int py0 = std::max(y0, int(std::floor(minY)));
+        int py1 = std::min(y1, int(std::ceil(maxY)));
+        if (px0 >= px1 || py0 >= py1)
+            continue;
+
+        // Edge functions E(x, y) = A*x + B*y + C, positive inside
+        float ea[3], eb[3], ec[3];
+        for (int k = 0; k < 3; ++k) {
+            int n = (k + 1) % 3;
+            ea[k] = -(tri.y[n] - tri.y[k]);
+            eb[k] = tri.x[n] - tri.x[k];
+            ec[k] = -(ea[k] * tri.x[k] + eb[k] * tri.y[k]);
+        }
+
+        // 1/w is affine in screen space; weight each vertex by the
+        // opposite edge to get the plane equation directly.
+        float area = ec[0] + ec[1] + ec[2];
+        if (area <= 0.0f)
+            continue;
+        float da = (ea[1] * tri.invW[0] + ea[2] * tri.invW[1] + ea[0] * tri.invW[2]) / area;
+        float db = (eb[1] * tri.invW[0] + eb[2] * tri.invW[1] + eb[0] * tri.invW[2]) / area;
+        float dc = (ec[1] * tri.invW[0] + ec[2] * tri.invW[1] + ec[0] * tri.invW[2]) / area;
+
+        for (int y = py0; y < py1; ++y) {
+            float *row = &m_depth[y * Width];
+            float cy = y + 0.5f;
+#if defined(DEPTH_RASTER_SSE2)
+            const __m128 zero = _mm_setzero_ps();
+            const __m128 offsets = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+            __m128 xs = _mm_add_ps(_mm_set1_ps(float(px0)), offsets);
+            const __m128 step = _mm_set1_ps(4.0f);
+            for (int x = px0; x < px1; x += 4) {
+                __m128 e0 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(ea[0]), xs),
+                                       _mm_set1_ps(eb[0] * cy + ec[0]));
+                __m128 e1 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(ea[1]), xs),
+                                       _mm_set1_ps(eb[1] * cy + ec[1]));
+                __m128 e2 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(ea[2]), xs),
+                                       _mm_set1_ps(eb[2] * cy + ec[2]));
+                __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero),
+                                                      _mm_cmpge_ps(e1, zero)),
+                                           _mm_cmpge_ps(e2, zero));
+                if (_mm_movemask_ps(inside) != 0) {
+                    __m128 depth = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(da), xs),
+                                              _mm_set1_ps(db * cy + dc));
+                    __m128 old = _mm_loadu_ps(row + x);
+                    __m128 closer = _mm_max_ps(old, depth);
+                    _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, closer),
+                                                     _mm_andnot_ps(inside, old)));
+                }
+                xs = _mm_add_ps(xs, step);
+            }
+#else
+            for (int x = px0; x < px1; ++x) {
+                float cx = x + 0.5f;
+                if (ea[0] * cx + eb[0] * cy + ec[0] < 0.0f
+                        || ea[1] * cx + eb[1] * cy + ec[1] < 0.0f
+                        || ea[2] * cx + eb[2] * cy + ec[2] < 0.0f)
+                    continue;
+                row[x] = std::max(row[x], da * cx + db * cy + dc);
+            }
+#endif
+        }
+    }
+}
+
+bool DepthRaster::testRect(const ScreenRect &rect) const
+{
+    // Entirely off screen; leave that to the GPU's clipping
+    if (rect.x0 >= rect.x1 || rect.y0 >= rect.y1)
+        return true;
+
+    const float threshold = rect.nearestInvW * (1.0f + s_depthBias);
+    for (int y = rect.y0; y < rect.y1; ++y) {
+        const float *row = &m_depth[y * Width];
+        int x = rect.x0;
+#if defined(DEPTH_RASTER_SSE2)
+        const __m128 limit = _mm_set1_ps(threshold);
+        for (; x + 4 <= rect.x1; x += 4) {
+            if (_mm_movemask_ps(_mm_cmplt_ps(_mm_loadu_ps(row + x), limit)) != 0)
+                return true;
+        }
+#endif
+        for (; x < rect.x1; ++x) {
+            if (row[x] < threshold)
+                return true;
+        }
+    }
+    return false;
+}
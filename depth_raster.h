@@ -0,0 +1,71 @@
+/* This file is part of PlasmaView.
+ *
+ * PlasmaView is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PlasmaView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Gneral Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PlasmaView.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DEPTH_RASTER_H
+#define _DEPTH_RASTER_H
+
+#include <vector>
+#include <cstddef>
+
+/* Coarse software depth buffer for occlusion culling.  Depth is stored as
+ * 1/w, so larger values are closer and a cleared buffer (0) is infinitely
+ * far away.  Rows can be cleared and rasterized in independent bands, so
+ * several threads can fill one buffer without locking.
+ */
+class DepthRaster
+{
+public:
+    enum { Width = 256, Height = 128 };
+
+    struct ScreenTri
+    {
+        float x[3], y[3], invW[3];
+    };
+
+    struct ScreenRect
+    {
+        int x0, y0, x1, y1;     // Inclusive-exclusive pixel bounds
+        float nearestInvW;
+    };
+
+    DepthRaster() : m_depth(Width * Height, 0.0f) { }
+
+    /* Transform triangles (9 floats each) by the column-major clip matrix
+     * and convert them to screen space.  Back faces and triangles outside
+     * the view are dropped, and triangles crossing the near plane are
+     * clipped against it.
+     */
+    static void setupTriangles(const float *clip, const float *positions,
+                               size_t triCount, std::vector<ScreenTri> &out);
+
+    /* Find the screen rectangle and nearest depth of an axis-aligned box.
+     * Returns false if the box crosses the near plane, in which case it
+     * must be treated as visible.
+     */
+    static bool projectBox(const float *clip, const float *boxMin,
+                           const float *boxMax, ScreenRect &rect);
+
+    void clear(int y0, int y1);
+    void rasterize(const std::vector<ScreenTri> &tris, int y0, int y1);
+
+    // True if any pixel under rect is farther away than the rect itself
+    bool testRect(const ScreenRect &rect) const;
+
+private:
+    std::vector<float> m_depth;
+};
+
+#endif
@@ -0,0 +1,34 @@
+/* This file is part of PlasmaView.
+ *
+ * PlasmaView is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PlasmaView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Gneral Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PlasmaView.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FUNCTION_JOB_H
+#define _FUNCTION_JOB_H
+
+#include <QRunnable>
+#include <functional>
+
+// Runs a function object on a QThreadPool
+class FunctionJob : public QRunnable
+{
+public:
+    FunctionJob(const std::function<void ()> &func) : m_func(func) { }
+    virtual void run() { m_func(); }
+
+private:
+    std::function<void ()> m_func;
+};
+
+#endif
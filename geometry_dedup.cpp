@@ -0,0 +1,226 @@
+/* This file is part of PlasmaView.
+ *
+ * PlasmaView is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PlasmaView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Gneral Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PlasmaView.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "geometry_dedup.h"
+
+#include <QVector4D>
+#include <cstring>
+
+// Same-topology meshes that aren't copies (quads, mostly) can pile up in
+// one bucket; don't let every new one be tested against all of them
+static const int s_maxCandidates = 16;
+
+// Exported copies are baked into world space separately, so allow for the
+// float error that comes with it: relative to the mesh's size, plus a bit
+// for how far from the origin it sits
+static const float s_positionTolerance = 1.0e-3f;
+static const float s_placementTolerance = 1.0e-5f;
+static const float s_normalTolerance = 1.0e-2f;
+
+static QVector3D vertexPosition(const unsigned char *vertices, size_t stride, size_t v)
+{
+    float pos[3];
+    memcpy(pos, vertices + v * stride, sizeof(pos));
+    return QVector3D(pos[0], pos[1], pos[2]);
+}
+
+static QVector3D vertexNormal(const unsigned char *vertices, size_t stride,
+                             size_t normalOffset, size_t v)
+{
+    float norm[3];
+    memcpy(norm, vertices + v * stride + normalOffset, sizeof(norm));
+    return QVector3D(norm[0], norm[1], norm[2]);
+}
+
+void GeometryDedup::clear()
+{
+    m_entries.clear();
+    m_buckets.clear();
+}
+
+size_t GeometryDedup::residentBytes() const
+{
+    size_t bytes = 0;
+    for (const Entry &entry : m_entries)
+        bytes += entry.m_vertices.size() + entry.m_indices.size() * sizeof(unsigned short);
+    return bytes;
+}
+
+bool GeometryDedup::find(const Mesh &mesh, Match &match) const
+{
+    if (mesh.m_vertexCount == 0 || mesh.m_indexCount == 0)
+        return false;
+
+    const uint hash = contentHash(mesh);
+    int tested = 0;
+    for (auto it = m_buckets.find(hash); it != m_buckets.end() && it.key() == hash; ++it) {
+        if (tested++ >= s_maxCandidates)
+            break;
+        if (matches(m_entries[it.value()], mesh, match.m_transform)) {
+            match.m_id = it.value();
+            return true;
+        }
+    }
+    return false;
+}
+
+int GeometryDedup::add(const Mesh &mesh)
+{
+    Entry entry;
+    if (mesh.m_vertexCount == 0 || mesh.m_indexCount == 0
+            || !chooseAnchors(mesh, entry.m_anchorA, entry.m_anchorB)
+            || !buildFrame(mesh, entry.m_anchorA, entry.m_anchorB, entry.m_frame))
+        return -1;
+
+    entry.m_vertices.assign(mesh.m_vertices, mesh.m_vertices + mesh.m_vertexCount * mesh.m_stride);
+    entry.m_indices.assign(mesh.m_indices, mesh.m_indices + mesh.m_indexCount);
+    entry.m_stride = mesh.m_stride;
+    entry.m_normalOffset = mesh.m_normalOffset;
+    entry.m_format = mesh.m_format;
+
+    const int id = static_cast<int>(m_entries.size());
+    m_entries.push_back(std::move(entry));
+    m_buckets.insert(contentHash(mesh), id);
+    return id;
+}
+
+uint GeometryDedup::contentHash(const Mesh &mesh)
+{
+    // Everything except the positions and normals, which the transform moves
+    uint hash = qHash(mesh.m_format) ^ qHash(uint(mesh.m_vertexCount));
+    hash = qHashBits(mesh.m_indices, mesh.m_indexCount * sizeof(unsigned short), hash);
+
+    const size_t skinEnd = mesh.m_normalOffset;
+    const size_t attribStart = mesh.m_normalOffset + 3 * sizeof(float);
+    for (size_t v = 0; v < mesh.m_vertexCount; ++v) {
+        const unsigned char *vert = mesh.m_vertices + v * mesh.m_stride;
+        hash = qHashBits(vert + 3 * sizeof(float), skinEnd - 3 * sizeof(float), hash);
+        hash = qHashBits(vert + attribStart, mesh.m_stride - attribStart, hash);
+    }
+    return hash;
+}
+
+bool GeometryDedup::chooseAnchors(const Mesh &mesh, size_t &anchorA, size_t &anchorB)
+{
+    QVector3D centroid;
+    for (size_t v = 0; v < mesh.m_vertexCount; ++v)
+        centroid += vertexPosition(mesh.m_vertices, mesh.m_stride, v);
+    centroid /= float(mesh.m_vertexCount);
+
+    // The farthest vertex from the center fixes the first axis...
+    float best = 0.0f;
+    anchorA = 0;
+    for (size_t v = 0; v < mesh.m_vertexCount; ++v) {
+        float dist = (vertexPosition(mesh.m_vertices, mesh.m_stride, v) - centroid).lengthSquared();
+        if (dist > best) {
+            best = dist;
+            anchorA = v;
+        }
+    }
+    if (best <= 0.0f)
+        return false;
+
+    // ...and the one farthest off that axis fixes the second
+    QVector3D axis = (vertexPosition(mesh.m_vertices, mesh.m_stride, anchorA) - centroid).normalized();
+    best = 0.0f;
+    anchorB = 0;
+    for (size_t v = 0; v < mesh.m_vertexCount; ++v) {
+        QVector3D offset = vertexPosition(mesh.m_vertices, mesh.m_stride, v) - centroid;
+        float dist = QVector3D::crossProduct(offset, axis).lengthSquared();
+        if (dist > best) {
+            best = dist;
+            anchorB = v;
+        }
+    }
+    return best > 0.0f;
+}
+
+bool GeometryDedup::buildFrame(const Mesh &mesh, size_t anchorA, size_t anchorB, Frame &frame)
+{
+    QVector3D centroid;
+    for (size_t v = 0; v < mesh.m_vertexCount; ++v)
+        centroid += vertexPosition(mesh.m_vertices, mesh.m_stride, v);
+    centroid /= float(mesh.m_vertexCount);
+
+    QVector3D toA = vertexPosition(mesh.m_vertices, mesh.m_stride, anchorA) - centroid;
+    QVector3D toB = vertexPosition(mesh.m_vertices, mesh.m_stride, anchorB) - centroid;
+    frame.m_scale = toA.length();
+    if (frame.m_scale <= 0.0f)
+        return false;
+
+    QVector3D xAxis = toA / frame.m_scale;
+    QVector3D yAxis = toB - xAxis * QVector3D::dotProduct(toB, xAxis);
+    if (yAxis.length() <= frame.m_scale * 1.0e-3f)
+        return false;
+    yAxis.normalize();
+
+    // Built right-handed, so a mirrored copy never matches
+    frame.m_origin = centroid;
+    frame.m_rotation.setToIdentity();
+    frame.m_rotation.setColumn(0, QVector4D(xAxis, 0.0f));
+    frame.m_rotation.setColumn(1, QVector4D(yAxis, 0.0f));
+    frame.m_rotation.setColumn(2, QVector4D(QVector3D::crossProduct(xAxis, yAxis), 0.0f));
+    return true;
+}
+
+bool GeometryDedup::matches(const Entry &entry, const Mesh &mesh, QMatrix4x4 &transform)
+{
+    if (entry.m_format != mesh.m_format || entry.m_stride != mesh.m_stride
+            || entry.m_normalOffset != mesh.m_normalOffset
+            || entry.m_vertices.size() != mesh.m_vertexCount * mesh.m_stride
+            || entry.m_indices.size() != mesh.m_indexCount)
+        return false;
+    if (memcmp(entry.m_indices.data(), mesh.m_indices,
+               mesh.m_indexCount * sizeof(unsigned short)) != 0)
+        return false;
+
+    const size_t attribStart = mesh.m_normalOffset + 3 * sizeof(float);
+    for (size_t v = 0; v < mesh.m_vertexCount; ++v) {
+        const unsigned char *ours = entry.m_vertices.data() + v * mesh.m_stride;
+        const unsigned char *theirs = mesh.m_vertices + v * mesh.m_stride;
+        if (memcmp(ours + 3 * sizeof(float), theirs + 3 * sizeof(float),
+                   mesh.m_normalOffset - 3 * sizeof(float)) != 0
+                || memcmp(ours + attribStart, theirs + attribStart,
+                          mesh.m_stride - attribStart) != 0)
+            return false;
+    }
+
+    Frame frame;
+    if (!buildFrame(mesh, entry.m_anchorA, entry.m_anchorB, frame))
+        return false;
+
+    QMatrix4x4 rotation = frame.m_rotation * entry.m_frame.m_rotation.transposed();
+    transform.setToIdentity();
+    transform.translate(frame.m_origin);
+    transform *= rotation;
+    transform.scale(frame.m_scale / entry.m_frame.m_scale);
+    transform.translate(-entry.m_frame.m_origin);
+
+    const float tolerance = s_positionTolerance * frame.m_scale
+                          + s_placementTolerance * frame.m_origin.length();
+    for (size_t v = 0; v < mesh.m_vertexCount; ++v) {
+        QVector3D mapped = transform.map(vertexPosition(entry.m_vertices.data(), mesh.m_stride, v));
+        if ((mapped - vertexPosition(mesh.m_vertices, mesh.m_stride, v)).length() > tolerance)
+            return false;
+
+        QVector3D normal = rotation.mapVector(vertexNormal(entry.m_vertices.data(), mesh.m_stride,
+                                                           mesh.m_normalOffset, v));
+        if ((normal - vertexNormal(mesh.m_vertices, mesh.m_stride, mesh.m_normalOffset, v)).length()
+                > s_normalTolerance)
+            return false;
+    }
+    return true;
+}
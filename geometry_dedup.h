@@ -0,0 +1,92 @@
+/* This file is part of PlasmaView.
+ *
+ * PlasmaView is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PlasmaView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Gneral Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PlasmaView.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GEOMETRY_DEDUP_H
+#define _GEOMETRY_DEDUP_H
+
+#include <QMultiHash>
+#include <QMatrix4x4>
+#include <QVector3D>
+#include <vector>
+#include <cstddef>
+
+/* Recognizes meshes which repeat an earlier one, up to a rotation,
+ * translation and uniform scale.  Candidates are bucketed by a hash of
+ * everything a transform leaves alone (topology and the non-spatial vertex
+ * attributes), then checked vertex by vertex against a frame anchored on
+ * two of their own vertices.
+ */
+class GeometryDedup
+{
+public:
+    // One span's vertices, with indices relative to its first vertex
+    struct Mesh
+    {
+        const unsigned char *m_vertices;
+        size_t m_vertexCount;
+        size_t m_stride;
+        size_t m_normalOffset;      // Position is always at offset 0
+        unsigned int m_format;
+        const unsigned short *m_indices;
+        size_t m_indexCount;
+    };
+
+    struct Match
+    {
+        int m_id;
+        QMatrix4x4 m_transform;     // Maps the original onto the new mesh
+    };
+
+    void clear();
+
+    // Bytes held for the meshes passed to add()
+    size_t residentBytes() const;
+
+    // True if mesh repeats one passed to add() since the last clear()
+    bool find(const Mesh &mesh, Match &match) const;
+
+    // Remember mesh as an original; returns its id, or -1 if it has no
+    // well-defined frame (points, lines) and so can never be matched
+    int add(const Mesh &mesh);
+
+private:
+    struct Frame
+    {
+        QVector3D m_origin;
+        QMatrix4x4 m_rotation;
+        float m_scale;
+    };
+
+    struct Entry
+    {
+        std::vector<unsigned char> m_vertices;
+        std::vector<unsigned short> m_indices;
+        size_t m_stride, m_normalOffset;
+        unsigned int m_format;
+        size_t m_anchorA, m_anchorB;
+        Frame m_frame;
+    };
+
+    std::vector<Entry> m_entries;
+    QMultiHash<uint, int> m_buckets;
+
+    static uint contentHash(const Mesh &mesh);
+    static bool chooseAnchors(const Mesh &mesh, size_t &anchorA, size_t &anchorB);
+    static bool buildFrame(const Mesh &mesh, size_t anchorA, size_t anchorB, Frame &frame);
+    static bool matches(const Entry &entry, const Mesh &mesh, QMatrix4x4 &transform);
+};
+
+#endif
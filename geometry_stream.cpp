@@ -0,0 +1,145 @@
+/* This file is part of PlasmaView.
+ *
+ * PlasmaView is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PlasmaView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Gneral Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PlasmaView.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "geometry_stream.h"
+#include "mapped_stream.h"
+
+#include <ResManager/plResManager.h>
+#include <PRP/Geometry/plDrawableSpans.h>
+#include <Debug/hsExceptions.hpp>
+
+plDrawableSpans *GeometryStreamer::acquire(plDrawableSpans *spans)
+{
+    if (!isReleased(spans))
+        return spans;
+    return reload(spans);
+}
+
+void GeometryStreamer::setEnabled(bool enabled)
+{
+    m_enabled = enabled;
+    if (enabled)
+        return;
+
+    // Otherwise every later look at these pages would parse them again
+    std::set<plDrawableSpans *> released = m_released;
+    for (plDrawableSpans *spans : released) {
+        plDrawableSpans *copy = reload(spans);
+        if (copy)
+            restore(spans, copy);
+    }
+}
+
+void GeometryStreamer::finish(plDrawableSpans *spans, plDrawableSpans *source)
+{
+    if (source != spans) {
+        if (!m_enabled)
+            restore(spans, source);
+        else
+            discard(spans, source);
+    }
+    if (m_enabled && !isReleased(spans))
+        release(spans);
+}
+
+size_t GeometryStreamer::residentBytes(plDrawableSpans *spans)
+{
+    size_t bytes = 0;
+    for (size_t grp = 0; grp < spans->getNumBufferGroups(); ++grp) {
+        plGBufferGroup *group = spans->getBuffer(grp);
+        for (size_t buf = 0; buf < group->getNumVertBuffers(); ++buf)
+            bytes += group->getVertBufferSize(buf);
+        for (size_t buf = 0; buf < group->getNumIdxBuffers(); ++buf)
+            bytes += group->getIdxBufferCount(buf) * sizeof(unsigned short);
+    }
+    return bytes;
+}
+
+void GeometryStreamer::release(plDrawableSpans *spans)
+{
+    // Empty the buffers rather than deleting them, so the spans' buffer
+    // indices stay valid for anything else that walks the drawable.
+    for (size_t grp = 0; grp < spans->getNumBufferGroups(); ++grp) {
+        plGBufferGroup *group = spans->getBuffer(grp);
+        for (size_t buf = 0; buf < group->getNumVertBuffers(); ++buf)
+            group->setVertices(buf, std::vector<plGBufferVertex>());
+        for (size_t buf = 0; buf < group->getNumIdxBuffers(); ++buf)
+            group->setIndices(buf, std::vector<unsigned short>());
+    }
+    m_released.insert(spans);
+}
+
+plDrawableSpans *GeometryStreamer::reload(plDrawableSpans *spans)
+{
+    plKey key = spans->getKey();
+    auto page = m_pageFiles.find(key->getLocation());
+    if (page == m_pageFiles.end()) {
+        qWarning("No PRP file known for %s; cannot reload its geometry",
+                 key->getName().c_str());
+        return nullptr;
+    }
+
+    // The drawable is parsed straight out of the page's mapping, so only
+    // the pages we actually touch are faulted in.
+    MappedFileStream S;
+    if (!S.open(page->second)) {
+        qWarning("Could not map %s to reload geometry", qPrintable(page->second));
+        return nullptr;
+    }
+    S.setVer(m_resMgr->getVer());
+
+    plDrawableSpans *copy = nullptr;
+    try {
+        S.seek(key->getFileOff());
+        copy = plDrawableSpans::Convert(m_resMgr->ReadCreatable(&S));
+    } catch (const hsException &ex) {
+        qWarning("Error reloading geometry for %s: %s",
+                 key->getName().c_str(), ex.what());
+    }
+
+    // Make sure reading the copy didn't re-point the key away from the
+    // object the rest of the viewer is holding on to while it's uploaded;
+    // discard() does the same again after the copy is deleted.
+    if (key->getObj() != spans)
+        key->setObj(spans);
+    return copy;
+}
+
+void GeometryStreamer::restore(plDrawableSpans *spans, plDrawableSpans *copy)
+{
+    // Both were read from the same record, so the buffers line up
+    for (size_t grp = 0; grp < spans->getNumBufferGroups(); ++grp) {
+        plGBufferGroup *group = spans->getBuffer(grp);
+        plGBufferGroup *source = copy->getBuffer(grp);
+        for (size_t buf = 0; buf < group->getNumVertBuffers(); ++buf)
+            group->setVertices(buf, source->getVertices(buf));
+        for (size_t buf = 0; buf < group->getNumIdxBuffers(); ++buf)
+            group->setIndices(buf, source->getIndices(buf));
+    }
+    m_released.erase(spans);
+    discard(spans, copy);
+}
+
+void GeometryStreamer::discard(plDrawableSpans *spans, plDrawableSpans *copy)
+{
+    // The copy from reload() shares the live object's key, so put the key
+    // back once the copy is gone in case its destruction touched it.
+    plKey key = spans->getKey();
+    delete copy;
+    if (key->getObj() != spans)
+        key->setObj(spans);
+    Q_ASSERT(key->getObj() == spans);
+}
@@ -0,0 +1,76 @@
+/* This file is part of PlasmaView.
+ *
+ * PlasmaView is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PlasmaView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Gneral Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PlasmaView.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GEOMETRY_STREAM_H
+#define _GEOMETRY_STREAM_H
+
+#include <map>
+#include <set>
+#include <QString>
+#include <PRP/KeyedObject/plLocation.h>
+
+class plResManager;
+class plDrawableSpans;
+
+/* Drops the CPU-side vertex and index storage of drawables once they have
+ * been uploaded to the GPU, and re-reads it from the page's PRP file the
+ * next time the geometry is needed (e.g. after the GL context is lost or
+ * the page has been evicted from the view).
+ */
+class GeometryStreamer
+{
+public:
+    GeometryStreamer(plResManager *mgr)
+        : m_resMgr(mgr), m_enabled(false) { }
+
+    // Disabling puts the storage of already released drawables back
+    void setEnabled(bool enabled);
+    bool enabled() const { return m_enabled; }
+
+    void setPageFile(const plLocation &loc, const QString &filename)
+    {
+        m_pageFiles[loc] = filename;
+    }
+
+    /* Returns a drawable whose buffer groups hold valid vertex and index
+     * storage for spans.  If spans was previously released, this is a
+     * temporary copy read back from the PRP, which must be handed back to
+     * finish() when the caller is done with it.
+     */
+    plDrawableSpans *acquire(plDrawableSpans *spans);
+    void finish(plDrawableSpans *spans, plDrawableSpans *source);
+
+    bool isReleased(plDrawableSpans *spans) const
+    {
+        return m_released.find(spans) != m_released.end();
+    }
+
+    // Bytes of vertex and index storage currently held in RAM for spans
+    static size_t residentBytes(plDrawableSpans *spans);
+
+private:
+    plResManager *m_resMgr;
+    std::map<plLocation, QString> m_pageFiles;
+    std::set<plDrawableSpans *> m_released;
+    bool m_enabled;
+
+    void release(plDrawableSpans *spans);
+    plDrawableSpans *reload(plDrawableSpans *spans);
+    void restore(plDrawableSpans *spans, plDrawableSpans *copy);
+    void discard(plDrawableSpans *spans, plDrawableSpans *copy);
+};
+
+#endif
@@ -0,0 +1,116 @@
+/* This file is part of PlasmaView.
+ *
+ * PlasmaView is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PlasmaView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Gneral Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PlasmaView.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "load_benchmark.h"
+#include "mapped_stream.h"
+
+#include <QDir>
+#include <QElapsedTimer>
+#include <cstdio>
+#include <ResManager/plResManager.h>
+#include <Debug/hsExceptions.hpp>
+
+#if defined(Q_OS_UNIX)
+#   include <fcntl.h>
+#   include <unistd.h>
+#endif
+
+// Best effort eviction of the files from the OS cache.  Only clean pages
+// can be dropped, and this is a no-op on platforms without fadvise.
+static bool dropFileCache(const QStringList &files)
+{
+#if defined(Q_OS_UNIX) && !defined(Q_OS_MAC)
+    foreach (const QString &file, files) {
+        int fd = ::open(QFile::encodeName(file).constData(), O_RDONLY);
+        if (fd < 0)
+            continue;
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        ::close(fd);
+    }
+    return true;
+#else
+    Q_UNUSED(files);
+    return false;
+#endif
+}
+
+static QStringList ageDataFiles(const QString &ageFile)
+{
+    QFileInfo info(ageFile);
+    QDir dir = info.absoluteDir();
+    QStringList files(info.absoluteFilePath());
+    foreach (const QString &prp, dir.entryList(QStringList(info.completeBaseName() + "_*.prp"),
+                                               QDir::Files))
+        files << dir.absoluteFilePath(prp);
+    return files;
+}
+
+static double timeLoad(const QString &ageFile, bool mapped)
+{
+    QElapsedTimer timer;
+    plResManager mgr;
+    timer.start();
+    try {
+        if (mapped)
+            readAgeMapped(&mgr, ageFile);
+        else
+            mgr.ReadAge(ageFile.toUtf8().constData(), true);
+    } catch (const hsException &ex) {
+        fprintf(stderr, "Error loading %s: %s\n", qPrintable(ageFile), ex.what());
+        return -1.0;
+    }
+    return timer.nsecsElapsed() / 1000000.0;
+}
+
+int runLoadBenchmark(const QStringList &ageFiles, int iterations)
+{
+    if (ageFiles.isEmpty()) {
+        fprintf(stderr, "Usage: PlasmaView --bench-load <file.age> [...]\n");
+        return 1;
+    }
+
+    QStringList allFiles;
+    foreach (const QString &age, ageFiles)
+        allFiles << ageDataFiles(age);
+    if (!dropFileCache(allFiles))
+        fprintf(stderr, "Warning: cannot drop the OS file cache here; "
+                        "\"cold\" timings will be warm\n");
+
+    fprintf(stdout, "%-32s %-9s %12s %12s\n", "Age", "Stream", "Cold (ms)", "Warm (ms)");
+    foreach (const QString &age, ageFiles) {
+        QStringList files = ageDataFiles(age);
+        for (int mode = 0; mode < 2; ++mode) {
+            bool mapped = (mode == 1);
+            double bestCold = -1.0, bestWarm = -1.0;
+            for (int i = 0; i < iterations; ++i) {
+                dropFileCache(files);
+                double cold = timeLoad(age, mapped);
+                double warm = timeLoad(age, mapped);
+                if (cold < 0.0 || warm < 0.0)
+                    return 1;
+                if (bestCold < 0.0 || cold < bestCold)
+                    bestCold = cold;
+                if (bestWarm < 0.0 || warm < bestWarm)
+                    bestWarm = warm;
+            }
+            fprintf(stdout, "%-32s %-9s %12.2f %12.2f\n",
+                    qPrintable(QFileInfo(age).completeBaseName()),
+                    mapped ? "mapped" : "buffered", bestCold, bestWarm);
+        }
+    }
+    return 0;
+}
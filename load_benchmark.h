@@ -0,0 +1,28 @@
+/* This file is part of PlasmaView.
+ *
+ * PlasmaView is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PlasmaView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Gneral Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PlasmaView.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LOAD_BENCHMARK_H
+#define _LOAD_BENCHMARK_H
+
+#include <QStringList>
+
+/* Times loading each age through plResManager::ReadAge's buffered file
+ * streams and through readAgeMapped(), with both a cold and a warm OS file
+ * cache, and prints the results to stdout.
+ */
+int runLoadBenchmark(const QStringList &ageFiles, int iterations = 3);
+
+#endif
@@ -0,0 +1,179 @@
+/* This file is part of PlasmaView.
+ *
+ * PlasmaView is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PlasmaView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Gneral Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PlasmaView.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lod_builder.h"
+#include "mesh_simplify.h"
+
+#include <QObject>
+#include <QMetaObject>
+#include <QStandardPaths>
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QSaveFile>
+#include <QFile>
+#include <QDir>
+
+// Bump whenever the simplifier or file layout changes, to orphan old files
+static const quint32 s_lodCacheMagic = 0x31444F4C;    // 'LOD1'
+static const quint32 s_lodCacheVersion = 1;
+
+// Spans smaller than this aren't worth reducing any further
+static const unsigned int s_minSpanIndices = 3 * 16;
+
+void LodBuilder::run()
+{
+    QString filename = cacheFile();
+    if (!loadCache(filename)) {
+        build();
+        saveCache(filename);
+    }
+
+    m_result->m_ready = true;
+    QMetaObject::invokeMethod(m_notify, "lodsReady", Qt::QueuedConnection);
+}
+
+QString LodBuilder::cacheDir()
+{
+    return QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation)
+            + "/PlasmaView/lod";
+}
+
+QString LodBuilder::cacheFile() const
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(reinterpret_cast<const char *>(m_positions.data()),
+                 m_positions.size() * sizeof(float));
+    hash.addData(reinterpret_cast<const char *>(m_indices.data()),
+                 m_indices.size() * sizeof(unsigned short));
+    for (const LodSpan &span : m_spans) {
+        quint32 range[2] = { span.m_first, span.m_count };
+        hash.addData(reinterpret_cast<const char *>(range), sizeof(range));
+    }
+    return cacheDir() + "/" + QString::fromLatin1(hash.result().toHex()) + ".lod";
+}
+
+bool LodBuilder::loadCache(const QString &filename)
+{
+    QFile file(filename);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    QDataStream stream(&file);
+    quint32 magic, version, levels;
+    stream >> magic >> version >> levels;
+    if (magic != s_lodCacheMagic || version != s_lodCacheVersion)
+        return false;
+
+    // Anything past here could come from a corrupt or foreign file, so
+    // nothing read is trusted to size an allocation or index a buffer.
+    if (levels > NumLevels)
+        return false;
+    const size_t vertexCount = m_positions.size() / 3;
+
+    std::vector<LodLevel> result(levels);
+    for (LodLevel &level : result) {
+        quint32 spanCount, indexCount;
+        stream >> spanCount;
+        if (spanCount != m_spans.size())
+            return false;
+        level.m_spans.resize(spanCount);
+        for (LodSpan &span : level.m_spans)
+            stream >> span.m_first >> span.m_count;
+
+        // Levels are only ever reductions of the full-detail indices
+        stream >> indexCount;
+        if (stream.status() != QDataStream::Ok || indexCount > m_indices.size())
+            return false;
+        level.m_indices.resize(indexCount);
+        const int bytes = int(indexCount * sizeof(unsigned short));
+        if (stream.readRawData(reinterpret_cast<char *>(level.m_indices.data()), bytes) != bytes)
+            return false;
+        for (unsigned short idx : level.m_indices) {
+            if (idx >= vertexCount)
+                return false;
+        }
+        for (const LodSpan &span : level.m_spans) {
+            if (span.m_first > indexCount || span.m_count > indexCount - span.m_first)
+                return false;
+        }
+    }
+    if (stream.status() != QDataStream::Ok)
+        return false;
+
+    m_result->m_levels.swap(result);
+    return true;
+}
+
+void LodBuilder::saveCache(const QString &filename)
+{
+    QDir().mkpath(cacheDir());
+    QSaveFile file(filename);
+    if (!file.open(QIODevice::WriteOnly))
+        return;
+
+    QDataStream stream(&file);
+    stream << s_lodCacheMagic << s_lodCacheVersion
+           << quint32(m_result->m_levels.size());
+    for (const LodLevel &level : m_result->m_levels) {
+        stream << quint32(level.m_spans.size());
+        for (const LodSpan &span : level.m_spans)
+            stream << span.m_first << span.m_count;
+        stream << quint32(level.m_indices.size());
+        stream.writeRawData(reinterpret_cast<const char *>(level.m_indices.data()),
+                            level.m_indices.size() * sizeof(unsigned short));
+    }
+    file.commit();
+}
+
+void LodBuilder::build()
+{
+    const size_t vertexCount = m_positions.size() / 3;
+
+    // Each level is simplified from the one before it, halving the
+    // triangle count of every span each time.
+    std::vector<unsigned short> prevIndices = m_indices;
+    std::vector<LodSpan> prevSpans = m_spans;
+    for (int lvl = 1; lvl <= NumLevels; ++lvl) {
+        LodLevel level;
+        level.m_indices.reserve(prevIndices.size() / 2);
+        for (size_t s = 0; s < prevSpans.size(); ++s) {
+            const LodSpan &prev = prevSpans[s];
+            unsigned int target = ((m_spans[s].m_count / 3) >> lvl) * 3;
+            if (target < s_minSpanIndices)
+                target = s_minSpanIndices;
+
+            std::vector<unsigned short> reduced;
+            if (prev.m_count > target) {
+                reduced = simplifyMesh(m_positions.data(), vertexCount,
+                                       prevIndices.data() + prev.m_first,
+                                       prev.m_count, target);
+            } else {
+                reduced.assign(prevIndices.begin() + prev.m_first,
+                               prevIndices.begin() + prev.m_first + prev.m_count);
+            }
+
+            level.m_spans.push_back(LodSpan(level.m_indices.size(), reduced.size()));
+            level.m_indices.insert(level.m_indices.end(), reduced.begin(), reduced.end());
+        }
+
+        // Stop once nothing is getting any simpler
+        if (level.m_indices.size() >= prevIndices.size())
+            break;
+        prevIndices = level.m_indices;
+        prevSpans = level.m_spans;
+        m_result->m_levels.push_back(std::move(level));
+    }
+}
@@ -0,0 +1,85 @@
+/* This file is part of PlasmaView.
+ *
+ * PlasmaView is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PlasmaView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Gneral Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PlasmaView.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LOD_BUILDER_H
+#define _LOD_BUILDER_H
+
+#include <QRunnable>
+#include <QString>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+class QObject;
+
+struct LodSpan
+{
+    unsigned int m_first, m_count;
+
+    LodSpan() : m_first(0), m_count(0) { }
+    LodSpan(unsigned int first, unsigned int count)
+        : m_first(first), m_count(count) { }
+};
+
+// One reduced-detail index buffer, with the range each span occupies in it
+struct LodLevel
+{
+    std::vector<unsigned short> m_indices;
+    std::vector<LodSpan> m_spans;
+};
+
+struct LodSet
+{
+    std::atomic<bool> m_ready;
+    std::vector<LodLevel> m_levels;
+
+    LodSet() : m_ready(false) { }
+};
+
+/* Background job which builds (or loads from the on-disk cache) the
+ * reduced-detail levels for one vertex/index buffer pair.  When the result
+ * is ready, the notify object's lodsReady() slot is invoked through a
+ * queued connection.
+ */
+class LodBuilder : public QRunnable
+{
+public:
+    enum { NumLevels = 3 };
+
+    LodBuilder(const std::shared_ptr<LodSet> &result, QObject *notify,
+               std::vector<float> positions, std::vector<unsigned short> indices,
+               std::vector<LodSpan> spans)
+        : m_result(result), m_notify(notify), m_positions(std::move(positions)),
+          m_indices(std::move(indices)), m_spans(std::move(spans)) { }
+
+    virtual void run();
+
+    static QString cacheDir();
+
+private:
+    std::shared_ptr<LodSet> m_result;
+    QObject *m_notify;
+    std::vector<float> m_positions;
+    std::vector<unsigned short> m_indices;
+    std::vector<LodSpan> m_spans;
+
+    QString cacheFile() const;
+    bool loadCache(const QString &filename);
+    void saveCache(const QString &filename);
+    void build();
+};
+
+#endif
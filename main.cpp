@@ -17,10 +17,46 @@
 #include <QApplication>
 #include <QIcon>
 #include <QGLFormat>
+#include <cstring>
 #include "plasmaview.h"
+#include "load_benchmark.h"
+#include "thumbnail_batch.h"
+
+// No platform was asked for, and the default one has no display to use
+static bool isHeadless(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-platform") == 0)
+            return false;
+    }
+    if (!qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+        return false;
+#if defined(Q_OS_UNIX) && !defined(Q_OS_MAC)
+    return qEnvironmentVariableIsEmpty("DISPLAY")
+        && qEnvironmentVariableIsEmpty("WAYLAND_DISPLAY");
+#else
+    return false;
+#endif
+}
 
 int main(int argc, char *argv[])
 {
+    if (argc > 1 && strcmp(argv[1], "--bench-load") == 0) {
+        QCoreApplication app(argc, argv);
+        return runLoadBenchmark(app.arguments().mid(2));
+    }
+
+    if (argc > 1 && strcmp(argv[1], "--thumbnails") == 0) {
+        // Without a display the default plugin aborts before any context
+        // exists.  Whether "offscreen" can do OpenGL depends on how Qt was
+        // built; where it can't, pass -platform eglfs with a headless EGL
+        // driver (e.g. EGL_PLATFORM=surfaceless on Mesa).
+        if (isHeadless(argc, argv))
+            qputenv("QT_QPA_PLATFORM", "offscreen");
+        QGuiApplication app(argc, argv);
+        return runThumbnailBatch(app.arguments().mid(2));
+    }
+
     QApplication app(argc, argv);
 
     QGLFormat format;
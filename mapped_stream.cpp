@@ -0,0 +1,130 @@
+/* This file is part of PlasmaView.
+ *
+ * PlasmaView is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PlasmaView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Gneral Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PlasmaView.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mapped_stream.h"
+#include "plasma_util.h"
+
+#include <QDir>
+#include <cstring>
+#include <ResManager/plResManager.h>
+#include <Debug/hsExceptions.hpp>
+
+bool MappedFileStream::open(const QString &filename)
+{
+    close();
+
+    m_file.setFileName(filename);
+    if (!m_file.open(QIODevice::ReadOnly))
+        return false;
+
+    // PRPs address everything with 32-bit offsets
+    if (m_file.size() > 0xFFFFFFFFLL) {
+        m_file.close();
+        return false;
+    }
+
+    m_size = static_cast<uint32_t>(m_file.size());
+    if (m_size != 0) {
+        m_data = m_file.map(0, m_size);
+        if (!m_data) {
+            m_file.close();
+            m_size = 0;
+            return false;
+        }
+    }
+    m_pos = 0;
+    return true;
+}
+
+void MappedFileStream::close()
+{
+    if (m_data)
+        m_file.unmap(const_cast<unsigned char *>(m_data));
+    if (m_file.isOpen())
+        m_file.close();
+    m_data = nullptr;
+    m_size = 0;
+    m_pos = 0;
+}
+
+void MappedFileStream::seek(uint32_t pos)
+{
+    m_pos = (pos > m_size) ? m_size : pos;
+}
+
+void MappedFileStream::skip(int32_t count)
+{
+    if (count < 0 && static_cast<uint32_t>(-count) > m_pos)
+        m_pos = 0;
+    else
+        seek(m_pos + count);
+}
+
+size_t MappedFileStream::read(size_t size, void *buf)
+{
+    if (size > m_size - m_pos)
+        throw hsFileReadException(__FILE__, __LINE__, "Read past end of mapped file");
+    memcpy(buf, m_data + m_pos, size);
+    m_pos += size;
+    return size;
+}
+
+size_t MappedFileStream::write(size_t, const void *)
+{
+    throw hsFileWriteException(__FILE__, __LINE__, "Mapped file streams are read-only");
+}
+
+QString pageFilePath(const QDir &dir, plAgeInfo *age, size_t pg, PlasmaVer ver)
+{
+    QString path = dir.absoluteFilePath(STToQString(age->getPageFilename(pg, ver)));
+    if (!QFile::exists(path)) {
+        QString alt = dir.absoluteFilePath(QString("%1_%2.prp")
+                .arg(STToQString(age->getAgeName()))
+                .arg(STToQString(age->getPage(pg).fName)));
+        if (QFile::exists(alt))
+            path = alt;
+    }
+    return QDir::toNativeSeparators(path);
+}
+
+plPageInfo *readPageMapped(plResManager *mgr, const QString &filename)
+{
+    MappedFileStream S;
+    if (!S.open(filename)) {
+        qWarning("Could not map %s", qPrintable(filename));
+        return nullptr;
+    }
+    S.setVer(mgr->getVer());
+    return mgr->ReadPage(&S);
+}
+
+plAgeInfo *readAgeMapped(plResManager *mgr, const QString &filename)
+{
+    plAgeInfo *age = mgr->ReadAge(filename.toUtf8().constData(), false);
+    QDir ageDir = QFileInfo(filename).absoluteDir();
+
+    for (size_t pg = 0; pg < age->getNumPages(); ++pg)
+        readPageMapped(mgr, pageFilePath(ageDir, age, pg, mgr->getVer()));
+
+    for (size_t pg = 0; pg < age->getNumCommonPages(mgr->getVer()); ++pg) {
+        QString path = ageDir.absoluteFilePath(
+                STToQString(age->getCommonPageFilename(pg, mgr->getVer())));
+        // Not every age ships its common pages
+        if (QFile::exists(path))
+            readPageMapped(mgr, QDir::toNativeSeparators(path));
+    }
+    return age;
+}
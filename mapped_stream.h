@@ -0,0 +1,72 @@
+/* This file is part of PlasmaView.
+ *
+ * PlasmaView is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PlasmaView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Gneral Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PlasmaView.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MAPPED_STREAM_H
+#define _MAPPED_STREAM_H
+
+#include <QFile>
+#include <Stream/hsStream.h>
+
+class QDir;
+class plResManager;
+class plAgeInfo;
+class plPageInfo;
+
+/* Read-only hsStream over a memory-mapped file.  Reads are served straight
+ * from the mapping, so the only copy made is into the caller's buffer.
+ */
+class MappedFileStream : public hsStream
+{
+public:
+    MappedFileStream() : m_data(nullptr), m_size(0), m_pos(0) { }
+    virtual ~MappedFileStream() { close(); }
+
+    bool open(const QString &filename);
+    void close();
+
+    virtual uint32_t size() const { return m_size; }
+    virtual uint32_t pos() const { return m_pos; }
+    virtual bool eof() const { return m_pos >= m_size; }
+
+    virtual void seek(uint32_t pos);
+    virtual void skip(int32_t count);
+    virtual void fastForward() { m_pos = m_size; }
+    virtual void rewind() { m_pos = 0; }
+
+    virtual size_t read(size_t size, void *buf);
+    virtual size_t write(size_t size, const void *buf);
+
+private:
+    QFile m_file;
+    const unsigned char *m_data;
+    uint32_t m_size, m_pos;
+};
+
+/* Locate the PRP for page pg of age in dir.  The district and non-district
+ * naming schemes are both tried, since the version may not be known yet
+ * when the first page is opened.
+ */
+QString pageFilePath(const QDir &dir, plAgeInfo *age, size_t pg, PlasmaVer ver);
+
+// Read a single PRP through a MappedFileStream; nullptr if it can't be mapped
+plPageInfo *readPageMapped(plResManager *mgr, const QString &filename);
+
+/* Equivalent to plResManager::ReadAge(filename, true), but reads each page
+ * through a MappedFileStream instead of a buffered file stream.
+ */
+plAgeInfo *readAgeMapped(plResManager *mgr, const QString &filename);
+
+#endif
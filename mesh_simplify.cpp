@@ -0,0 +1,304 @@
+/* This file is part of PlasmaView.
+ *
+ * PlasmaView is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PlasmaView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Gneral Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PlasmaView.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mesh_simplify.h"
+
+#include <algorithm>
+#include <map>
+#include <queue>
+#include <tuple>
+#include <cmath>
+
+// Extra weight on the planes that pin down open edges
+static const double s_boundaryWeight = 100.0;
+
+namespace
+{
+    struct Vec3
+    {
+        double x, y, z;
+
+        Vec3() : x(0.0), y(0.0), z(0.0) { }
+        Vec3(double x_, double y_, double z_) : x(x_), y(y_), z(z_) { }
+
+        Vec3 operator-(const Vec3 &other) const
+        {
+            return Vec3(x - other.x, y - other.y, z - other.z);
+        }
+
+        double dot(const Vec3 &other) const
+        {
+            return x * other.x + y * other.y + z * other.z;
+        }
+
+        Vec3 cross(const Vec3 &other) const
+        {
+            return Vec3(y * other.z - z * other.y,
+                        z * other.x - x * other.z,
+                        x * other.y - y * other.x);
+        }
+
+        double length() const { return std::sqrt(dot(*this)); }
+    };
+
+    // Symmetric 4x4 matrix, upper triangle only
+    struct Quadric
+    {
+        double m[10];
+
+        Quadric() { for (int i = 0; i < 10; ++i) m[i] = 0.0; }
+
+        void addPlane(const Vec3 &n, double d, double weight)
+        {
+            m[0] += weight * n.x * n.x;
+            m[1] += weight * n.x * n.y;
+            m[2] += weight * n.x * n.z;
+            m[3] += weight * n.x * d;
+            m[4] += weight * n.y * n.y;
+            m[5] += weight * n.y * n.z;
+            m[6] += weight * n.y * d;
+            m[7] += weight * n.z * n.z;
+            m[8] += weight * n.z * d;
+            m[9] += weight * d * d;
+        }
+
+        Quadric &operator+=(const Quadric &other)
+        {
+            for (int i = 0; i < 10; ++i)
+                m[i] += other.m[i];
+            return *this;
+        }
+
+        double error(const Vec3 &p) const
+        {
+            return p.x * (m[0] * p.x + 2.0 * (m[1] * p.y + m[2] * p.z + m[3]))
+                 + p.y * (m[4] * p.y + 2.0 * (m[5] * p.z + m[6]))
+                 + p.z * (m[7] * p.z + 2.0 * m[8])
+                 + m[9];
+        }
+    };
+
+    struct Collapse
+    {
+        double cost;
+        int from, to;
+        unsigned int fromVersion, toVersion;
+
+        bool operator<(const Collapse &other) const
+        {
+            // std::priority_queue is a max-heap
+            return cost > other.cost;
+        }
+    };
+}
+
+std::vector<unsigned short> simplifyMesh(const float *positions, size_t vertexCount,
+                                         const unsigned short *indices, size_t indexCount,
+                                         size_t targetIndexCount)
+{
+    const size_t triCount = indexCount / 3;
+    std::vector<unsigned short> result(indices, indices + triCount * 3);
+    if (result.size() <= targetIndexCount)
+        return result;
+
+    // Weld vertices by position, so UV and color seams don't tear open
+    std::map<std::tuple<float, float, float>, int> nodeLookup;
+    std::vector<int> vertNode(vertexCount, -1);
+    std::vector<Vec3> nodePos;
+    std::vector<unsigned short> nodeRep;
+    for (size_t i = 0; i < result.size(); ++i) {
+        unsigned short vert = result[i];
+        if (vert >= vertexCount)
+            return result;
+        if (vertNode[vert] >= 0)
+            continue;
+
+        const float *pos = positions + 3 * vert;
+        auto key = std::make_tuple(pos[0], pos[1], pos[2]);
+        auto iter = nodeLookup.find(key);
+        if (iter == nodeLookup.end()) {
+            iter = nodeLookup.insert(std::make_pair(key, int(nodePos.size()))).first;
+            nodePos.push_back(Vec3(pos[0], pos[1], pos[2]));
+            nodeRep.push_back(vert);
+        }
+        vertNode[vert] = iter->second;
+    }
+
+    const size_t nodeCount = nodePos.size();
+    std::vector<int> triNodes(triCount * 3);
+    std::vector<bool> triAlive(triCount, true);
+    std::vector<std::vector<int> > nodeTris(nodeCount);
+    std::vector<Quadric> quadrics(nodeCount);
+    std::map<std::pair<int, int>, int> edgeUse;
+    size_t liveTris = 0;
+
+    for (size_t t = 0; t < triCount; ++t) {
+        int a = vertNode[result[t*3]], b = vertNode[result[t*3 + 1]], c = vertNode[result[t*3 + 2]];
+        triNodes[t*3] = a;
+        triNodes[t*3 + 1] = b;
+        triNodes[t*3 + 2] = c;
+        if (a == b || b == c || c == a) {
+            triAlive[t] = false;
+            continue;
+        }
+        ++liveTris;
+
+        Vec3 normal = (nodePos[b] - nodePos[a]).cross(nodePos[c] - nodePos[a]);
+        double area2 = normal.length();
+        if (area2 > 0.0) {
+            normal = Vec3(normal.x / area2, normal.y / area2, normal.z / area2);
+            double d = -normal.dot(nodePos[a]);
+            for (int k = 0; k < 3; ++k)
+                quadrics[triNodes[t*3 + k]].addPlane(normal, d, area2 * 0.5);
+        }
+
+        for (int k = 0; k < 3; ++k) {
+            int n0 = triNodes[t*3 + k], n1 = triNodes[t*3 + (k + 1) % 3];
+            nodeTris[n0].push_back(int(t));
+            edgeUse[std::make_pair(std::min(n0, n1), std::max(n0, n1))] += 1;
+        }
+    }
+
+    // Constrain open edges with a plane perpendicular to the face
+    for (size_t t = 0; t < triCount; ++t) {
+        if (!triAlive[t])
+            continue;
+        const Vec3 &p0 = nodePos[triNodes[t*3]];
+        Vec3 faceNormal = (nodePos[triNodes[t*3 + 1]] - p0).cross(nodePos[triNodes[t*3 + 2]] - p0);
+        for (int k = 0; k < 3; ++k) {
+            int n0 = triNodes[t*3 + k], n1 = triNodes[t*3 + (k + 1) % 3];
+            if (edgeUse[std::make_pair(std::min(n0, n1), std::max(n0, n1))] != 1)
+                continue;
+
+            Vec3 edge = nodePos[n1] - nodePos[n0];
+            Vec3 normal = edge.cross(faceNormal);
+            double len = normal.length();
+            if (len <= 0.0)
+                continue;
+            normal = Vec3(normal.x / len, normal.y / len, normal.z / len);
+            double d = -normal.dot(nodePos[n0]);
+            double weight = s_boundaryWeight * edge.dot(edge);
+            quadrics[n0].addPlane(normal, d, weight);
+            quadrics[n1].addPlane(normal, d, weight);
+        }
+    }
+
+    std::vector<bool> nodeAlive(nodeCount, true);
+    std::vector<unsigned int> nodeVersion(nodeCount, 0);
+    std::priority_queue<Collapse> queue;
+
+    auto pushCollapse = [&](int from, int to) {
+        Quadric q = quadrics[from];
+        q += quadrics[to];
+        Collapse col;
+        col.cost = q.error(nodePos[to]);
+        col.from = from;
+        col.to = to;
+        col.fromVersion = nodeVersion[from];
+        col.toVersion = nodeVersion[to];
+        queue.push(col);
+    };
+
+    for (auto iter = edgeUse.begin(); iter != edgeUse.end(); ++iter) {
+        pushCollapse(iter->first.first, iter->first.second);
+        pushCollapse(iter->first.second, iter->first.first);
+    }
+
+    while (liveTris * 3 > targetIndexCount && !queue.empty()) {
+        Collapse col = queue.top();
+        queue.pop();
+        if (!nodeAlive[col.from] || !nodeAlive[col.to]
+                || col.fromVersion != nodeVersion[col.from]
+                || col.toVersion != nodeVersion[col.to])
+            continue;
+
+        // Reject collapses that would flip any of the remaining faces
+        bool flips = false;
+        bool adjacent = false;
+        for (int t : nodeTris[col.from]) {
+            if (!triAlive[t])
+                continue;
+            int *tri = &triNodes[t*3];
+            if (tri[0] == col.to || tri[1] == col.to || tri[2] == col.to) {
+                adjacent = true;
+                continue;
+            }
+
+            Vec3 before = (nodePos[tri[1]] - nodePos[tri[0]]).cross(nodePos[tri[2]] - nodePos[tri[0]]);
+            Vec3 moved[3];
+            for (int k = 0; k < 3; ++k)
+                moved[k] = nodePos[(tri[k] == col.from) ? col.to : tri[k]];
+            Vec3 after = (moved[1] - moved[0]).cross(moved[2] - moved[0]);
+            if (before.dot(after) <= 0.0) {
+                flips = true;
+                break;
+            }
+        }
+        if (flips || !adjacent)
+            continue;
+
+        for (int t : nodeTris[col.from]) {
+            if (!triAlive[t])
+                continue;
+            int *tri = &triNodes[t*3];
+            if (tri[0] == col.to || tri[1] == col.to || tri[2] == col.to) {
+                triAlive[t] = false;
+                --liveTris;
+                continue;
+            }
+            for (int k = 0; k < 3; ++k) {
+                if (tri[k] == col.from)
+                    tri[k] = col.to;
+            }
+            nodeTris[col.to].push_back(t);
+        }
+        nodeTris[col.from].clear();
+        nodeAlive[col.from] = false;
+        quadrics[col.to] += quadrics[col.from];
+        ++nodeVersion[col.to];
+
+        // Re-cost everything touching the surviving node
+        std::vector<int> &tris = nodeTris[col.to];
+        std::vector<int> live;
+        live.reserve(tris.size());
+        for (int t : tris) {
+            if (!triAlive[t])
+                continue;
+            live.push_back(t);
+            for (int k = 0; k < 3; ++k) {
+                int other = triNodes[t*3 + k];
+                if (other == col.to)
+                    continue;
+                pushCollapse(col.to, other);
+                pushCollapse(other, col.to);
+            }
+        }
+        tris.swap(live);
+    }
+
+    std::vector<unsigned short> simplified;
+    simplified.reserve(liveTris * 3);
+    for (size_t t = 0; t < triCount; ++t) {
+        if (!triAlive[t])
+            continue;
+        for (int k = 0; k < 3; ++k) {
+            unsigned short vert = result[t*3 + k];
+            int node = triNodes[t*3 + k];
+            simplified.push_back(vertNode[vert] == node ? vert : nodeRep[node]);
+        }
+    }
+    return simplified;
+}
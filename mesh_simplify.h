@@ -0,0 +1,37 @@
+/* This file is part of PlasmaView.
+ *
+ * PlasmaView is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PlasmaView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Gneral Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PlasmaView.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MESH_SIMPLIFY_H
+#define _MESH_SIMPLIFY_H
+
+#include <vector>
+#include <cstddef>
+
+/* Simplify a triangle list with quadric error metric edge collapses
+ * (Garland & Heckbert).  Collapses are restricted to existing vertices, so
+ * the result is a new index list into the same vertex buffer.  Vertices
+ * sharing a position are collapsed together, and open boundaries are
+ * weighted so the silhouette is preserved.
+ *
+ * positions holds 3 floats per vertex.  Simplification stops once the
+ * result has at most targetIndexCount indices, or when no collapse is
+ * possible without flipping a triangle.
+ */
+std::vector<unsigned short> simplifyMesh(const float *positions, size_t vertexCount,
+                                         const unsigned short *indices, size_t indexCount,
+                                         size_t targetIndexCount);
+
+#endif
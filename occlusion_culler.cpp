@@ -0,0 +1,109 @@
+/* This file is part of PlasmaView.
+ *
+ * PlasmaView is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PlasmaView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Gneral Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PlasmaView.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "occlusion_culler.h"
+#include "function_job.h"
+
+#include <QThread>
+
+OcclusionCuller::OcclusionCuller()
+{
+    // Only one frame is culled at a time; the work pool splits it up
+    m_framePool.setMaxThreadCount(1);
+    m_workPool.setMaxThreadCount(qMax(1, QThread::idealThreadCount() - 1));
+}
+
+OcclusionCuller::~OcclusionCuller()
+{
+    m_framePool.clear();
+    m_framePool.waitForDone();
+}
+
+void OcclusionCuller::setOccluders(const std::vector<float> &triangles)
+{
+    m_framePool.waitForDone();
+    m_occluders = triangles;
+}
+
+void OcclusionCuller::setBoxes(const std::vector<Box> &boxes)
+{
+    m_framePool.waitForDone();
+    m_boxes = boxes;
+    m_visible.assign(m_boxes.size(), 1);
+}
+
+void OcclusionCuller::beginFrame(const QMatrix4x4 &viewProj)
+{
+    // A newer view supersedes any frame that hasn't started yet
+    m_framePool.clear();
+    m_framePool.start(new FunctionJob([this, viewProj]() {
+        runFrame(viewProj);
+    }));
+}
+
+const std::vector<unsigned char> &OcclusionCuller::results()
+{
+    m_framePool.waitForDone();
+    return m_visible;
+}
+
+OcclusionCuller::Stats OcclusionCuller::stats()
+{
+    m_framePool.waitForDone();
+    return m_stats;
+}
+
+void OcclusionCuller::runFrame(const QMatrix4x4 &viewProj)
+{
+    const float *clip = viewProj.constData();
+
+    m_screenTris.clear();
+    DepthRaster::setupTriangles(clip, m_occluders.data(), m_occluders.size() / 9,
+                                m_screenTris);
+
+    // Each band of rows is cleared and filled by its own job
+    const int jobs = m_workPool.maxThreadCount();
+    const int rowsPerBand = (DepthRaster::Height + jobs - 1) / jobs;
+    for (int y0 = 0; y0 < DepthRaster::Height; y0 += rowsPerBand) {
+        int y1 = qMin(y0 + rowsPerBand, int(DepthRaster::Height));
+        m_workPool.start(new FunctionJob([this, y0, y1]() {
+            m_raster.clear(y0, y1);
+            m_raster.rasterize(m_screenTris, y0, y1);
+        }));
+    }
+    m_workPool.waitForDone();
+
+    const size_t boxesPerJob = (m_boxes.size() + jobs - 1) / jobs;
+    for (size_t first = 0; first < m_boxes.size(); first += boxesPerJob) {
+        size_t last = qMin(first + boxesPerJob, m_boxes.size());
+        m_workPool.start(new FunctionJob([this, clip, first, last]() {
+            for (size_t i = first; i < last; ++i) {
+                DepthRaster::ScreenRect rect;
+                m_visible[i] = !DepthRaster::projectBox(clip, m_boxes[i].m_min,
+                                                        m_boxes[i].m_max, rect)
+                               || m_raster.testRect(rect);
+            }
+        }));
+    }
+    m_workPool.waitForDone();
+
+    m_stats.m_tested = int(m_boxes.size());
+    m_stats.m_rejected = 0;
+    for (unsigned char vis : m_visible) {
+        if (!vis)
+            ++m_stats.m_rejected;
+    }
+}
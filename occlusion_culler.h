@@ -0,0 +1,71 @@
+/* This file is part of PlasmaView.
+ *
+ * PlasmaView is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PlasmaView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Gneral Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PlasmaView.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _OCCLUSION_CULLER_H
+#define _OCCLUSION_CULLER_H
+
+#include <QMatrix4x4>
+#include <QThreadPool>
+#include <vector>
+#include "depth_raster.h"
+
+/* Rasterizes a handful of large occluders into a DepthRaster and tests a
+ * list of bounding boxes against it.  beginFrame() hands the work off to
+ * worker threads and returns immediately; results() blocks until the
+ * frame's visibility is known.
+ */
+class OcclusionCuller
+{
+public:
+    struct Box
+    {
+        float m_min[3], m_max[3];
+    };
+
+    struct Stats
+    {
+        int m_tested, m_rejected;
+
+        Stats() : m_tested(0), m_rejected(0) { }
+    };
+
+    OcclusionCuller();
+    ~OcclusionCuller();
+
+    // Occluder triangles are 9 floats each.  Both of these wait for any
+    // frame still in flight before replacing the scene.
+    void setOccluders(const std::vector<float> &triangles);
+    void setBoxes(const std::vector<Box> &boxes);
+
+    void beginFrame(const QMatrix4x4 &viewProj);
+
+    // One entry per box: nonzero if the box may be visible
+    const std::vector<unsigned char> &results();
+    Stats stats();
+
+private:
+    QThreadPool m_framePool, m_workPool;
+    DepthRaster m_raster;
+    std::vector<float> m_occluders;
+    std::vector<Box> m_boxes;
+    std::vector<unsigned char> m_visible;
+    std::vector<DepthRaster::ScreenTri> m_screenTris;
+    Stats m_stats;
+
+    void runFrame(const QMatrix4x4 &viewProj);
+};
+
+#endif
@@ -15,15 +15,31 @@
  */
 
 #include "plasma_scene.h"
+#include "geometry_stream.h"
+#include "lod_builder.h"
+#include "function_job.h"
+#include "plasma_util.h"
 
 #include <QMessageBox>
 #include <QKeyEvent>
 #include <QMouseEvent>
 #include <QMatrix4x4>
+#include <QThread>
+#include <QElapsedTimer>
+#include <QVector4D>
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
 #include <QtCore/qmath.h>
+#include <cstring>
+#include <cfloat>
+#include <climits>
+#include <algorithm>
 #include <PRP/Geometry/plDrawableSpans.h>
+#include <PRP/Geometry/plIcicle.h>
 
-static const float s_degPerRad = 0.0174532925f;
+// Only the biggest, cheapest spans are worth rasterizing as occluders
+static const size_t s_maxOccluders = 32;
+static const size_t s_maxOccluderTris = 2048;
 
 // Qt's samples inherit this to make it "look like raw OpenGL", but personally
 // I think that looks hacky, and I'd rather explicitly call out that I'm using
@@ -37,18 +53,39 @@ static const float s_degPerRad = 0.0174532925f;
 #endif
 
 PlasmaGLWidget::PlasmaGLWidget(QWidget *parent)
-    : QGLWidget(parent), m_theta(0.0f), m_phi(0.0f),
-      m_renderMode(RenderTextured)
+    : QGLWidget(parent), m_streamer(nullptr), m_theta(0.0f), m_phi(0.0f),
+      m_renderMode(RenderTextured), m_lodScale(1.0f), m_cullDirty(true),
+      m_cullStarted(false), m_dragged(false), m_dedupBytesSaved(0), m_drawCalls(0),
+      m_drawsSaved(0), m_vertexAttribDivisor(nullptr), sha_model(-1)
 {
     setAttribute(Qt::WA_NoSystemBackground);
     setFocusPolicy(Qt::StrongFocus);
+
+    // Leave a core free for the UI while LODs and pick trees are being built
+    m_lodPool.setMaxThreadCount(qMax(1, QThread::idealThreadCount() - 1));
+}
+
+PlasmaGLWidget::~PlasmaGLWidget()
+{
+    // The builders call back into us when they finish
+    m_lodPool.clear();
+    m_lodPool.waitForDone();
+    clear();
 }
 
 void PlasmaGLWidget::clear()
 {
+    m_lodPool.clear();
     foreach (RenderData *render, m_drawables)
         delete render;
     m_drawables.clear();
+    m_sources.clear();
+    m_occluders.clear();
+    m_cullDirty = true;
+    m_pickSpans.clear();
+    m_pickMeshes.clear();
+    m_pickTrees.clear();
+    resetDedup();
 
     m_position = QVector3D(0.0f, 0.0f, 0.0f);
     m_theta = 0.0f;
@@ -58,16 +95,46 @@ void PlasmaGLWidget::clear()
 
 void PlasmaGLWidget::addGeometry(plDrawableSpans *spans)
 {
-    for (size_t grp = 0; grp < spans->getNumBufferGroups(); ++grp) {
-        plGBufferGroup *group = spans->getBuffer(grp);
+    m_sources.append(spans);
+    uploadGeometry(spans);
+}
+
+void PlasmaGLWidget::uploadGeometry(plDrawableSpans *spans)
+{
+    plDrawableSpans *source = m_streamer ? m_streamer->acquire(spans) : spans;
+    if (!source)
+        return;
+
+    for (size_t grp = 0; grp < source->getNumBufferGroups(); ++grp) {
+        plGBufferGroup *group = source->getBuffer(grp);
         for (size_t buf = 0; buf < group->getNumVertBuffers(); ++buf) {
-            RenderData *render = new RenderData(
-                    group->getStride(),
-                    group->getIdxBufferCount(buf),
-                    (group->getFormat() & plGBufferGroup::kSkinWeightMask) >> 4,
-                    group->getFormat() & plGBufferGroup::kUVCountMask,
-                    (group->getFormat() & plGBufferGroup::kSkinIndices) != 0
-            );
+            RenderData *render = new RenderData(vertexLayout(group),
+                                                group->getIdxBufferCount(buf));
+
+            BufferData data;
+            readBuffer(source, grp, buf, render, data);
+            captureSpans(spans, data);
+            m_cullDirty = true;
+
+            // Spans repeating one seen earlier on this page are dropped from
+            // the upload and drawn as an instance of the original instead
+            std::vector<bool> keep;
+            const size_t kept = dedupSpans(render, group->getFormat(), data, keep);
+            const qint64 uploadBytes = qint64(data.m_vertexCount * render->m_layout.m_stride)
+                                     + qint64(render->m_indexCount * sizeof(GLushort));
+            if (kept == 0) {
+                m_dedupBytesSaved += uploadBytes;
+                delete render;
+                continue;
+            }
+            if (kept < data.m_spans.size()) {
+                compactBuffer(render->m_layout.m_stride, keep, data);
+                render->m_indexCount = static_cast<GLsizei>(data.m_indices.size());
+                m_dedupBytesSaved += uploadBytes
+                        - qint64(data.m_vertexCount * render->m_layout.m_stride)
+                        - qint64(render->m_indexCount * sizeof(GLushort));
+            }
+            render->m_spans = std::move(data.m_spanData);
 
             render->m_vao.create();
             render->m_vao.bind();
@@ -75,19 +142,235 @@ void PlasmaGLWidget::addGeometry(plDrawableSpans *spans)
             render->m_vBuffer.create();
             render->m_vBuffer.bind();
             render->m_vBuffer.setUsagePattern(QOpenGLBuffer::StaticDraw);
-            render->m_vBuffer.allocate(group->getVertBufferStorage(buf),
-                                       group->getVertBufferSize(buf));
+            render->m_vBuffer.allocate(data.m_vertices, data.m_vertexCount * render->m_layout.m_stride);
 
             render->m_iBuffer.create();
             render->m_iBuffer.bind();
             render->m_iBuffer.setUsagePattern(QOpenGLBuffer::StaticDraw);
-            render->m_iBuffer.allocate(
-                        static_cast<const GLushort *>(group->getIdxBufferStorage(buf)),
-                        render->m_indexCount * sizeof(GLushort));
+            render->m_iBuffer.allocate(data.m_indices.data(),
+                                       render->m_indexCount * sizeof(GLushort));
+
+            render->m_lods = std::make_shared<LodSet>();
+            m_lodPool.start(new LodBuilder(render->m_lods, this, std::move(data.m_positions),
+                                           std::move(data.m_indices), std::move(data.m_spans)));
 
             m_drawables.append(render);
         }
     }
+
+    if (m_streamer)
+        m_streamer->finish(spans, source);
+}
+
+void PlasmaGLWidget::readBuffer(plDrawableSpans *source, size_t grp, size_t buf,
+                                const RenderData *render, BufferData &data)
+{
+    // Keep our own copy of the positions and indices for the LOD
+    // builder, since the streamer may free the originals.
+    plGBufferGroup *group = source->getBuffer(grp);
+    const size_t stride = render->m_layout.m_stride;
+    const GLushort *idata = static_cast<const GLushort *>(group->getIdxBufferStorage(buf));
+    data.m_vertices = group->getVertBufferStorage(buf);
+    data.m_vertexCount = group->getVertBufferSize(buf) / stride;
+    data.m_positions.resize(data.m_vertexCount * 3);
+    for (size_t v = 0; v < data.m_vertexCount; ++v)
+        memcpy(&data.m_positions[v * 3], data.m_vertices + v * stride, 3 * sizeof(float));
+    data.m_indices.assign(idata, idata + render->m_indexCount);
+
+    for (size_t i = 0; i < source->getNumSpans(); ++i) {
+        plIcicle *ice = static_cast<plIcicle *>(source->getSpan(i));
+        if (ice->getGroupIdx() != grp || ice->getIBufferIdx() != buf)
+            continue;
+        if (ice->getIStartIdx() + ice->getILength() > size_t(render->m_indexCount))
+            continue;
+        data.m_spans.push_back(LodSpan(ice->getIStartIdx(), ice->getILength()));
+        data.m_spanIndices.push_back(static_cast<unsigned int>(i));
+        data.m_vertexRanges.push_back(LodSpan(ice->getVStartIdx(), ice->getVLength()));
+    }
+
+    if (data.m_spans.empty()) {
+        data.m_spans.push_back(LodSpan(0, render->m_indexCount));
+        data.m_spanIndices.push_back(UINT_MAX);
+        data.m_vertexRanges.push_back(LodSpan());
+        return;
+    }
+
+    // Indices no icicle covers would vanish as soon as a neighbour
+    // is culled or reduced, so they get full-detail spans of their own
+    std::vector<LodSpan> covered = data.m_spans;
+    std::sort(covered.begin(), covered.end(), [](const LodSpan &a, const LodSpan &b) {
+        return a.m_first < b.m_first;
+    });
+    covered.push_back(LodSpan(render->m_indexCount, 0));
+    unsigned int uncovered = 0;
+    for (const LodSpan &range : covered) {
+        if (range.m_first > uncovered) {
+            unsigned int count = (range.m_first - uncovered) / 3 * 3;
+            if (count > 0) {
+                data.m_spans.push_back(LodSpan(uncovered, count));
+                data.m_spanIndices.push_back(UINT_MAX);
+                data.m_vertexRanges.push_back(LodSpan());
+            }
+        }
+        uncovered = qMax(uncovered, range.m_first + range.m_count);
+    }
+
+    // In buffer order, so spans drawn at the same level can share a draw
+    std::vector<size_t> order(data.m_spans.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&data](size_t a, size_t b) {
+        return data.m_spans[a].m_first < data.m_spans[b].m_first;
+    });
+    std::vector<LodSpan> spans, vertexRanges;
+    std::vector<unsigned int> spanIndices;
+    for (size_t i : order) {
+        spans.push_back(data.m_spans[i]);
+        spanIndices.push_back(data.m_spanIndices[i]);
+        vertexRanges.push_back(data.m_vertexRanges[i]);
+    }
+    data.m_spans.swap(spans);
+    data.m_spanIndices.swap(spanIndices);
+    data.m_vertexRanges.swap(vertexRanges);
+}
+
+void PlasmaGLWidget::captureSpans(plDrawableSpans *spans, BufferData &data)
+{
+    const std::vector<float> &positions = data.m_positions;
+    const std::vector<unsigned short> &indices = data.m_indices;
+    const size_t vertexCount = data.m_vertexCount;
+
+    // Picking keeps the whole buffer, instanced spans included
+    TriangleBVH::Mesh pickMesh;
+    pickMesh.m_positions = positions;
+    pickMesh.m_indices = indices;
+
+    for (size_t ls = 0; ls < data.m_spans.size(); ++ls) {
+        const LodSpan &lodSpan = data.m_spans[ls];
+        QVector3D lo(FLT_MAX, FLT_MAX, FLT_MAX), hi(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+        for (unsigned int i = lodSpan.m_first; i < lodSpan.m_first + lodSpan.m_count; ++i) {
+            if (indices[i] >= vertexCount)
+                continue;
+            const float *pos = &positions[indices[i] * 3];
+            lo = QVector3D(qMin(lo.x(), pos[0]), qMin(lo.y(), pos[1]), qMin(lo.z(), pos[2]));
+            hi = QVector3D(qMax(hi.x(), pos[0]), qMax(hi.y(), pos[1]), qMax(hi.z(), pos[2]));
+        }
+
+        SpanData span;
+        span.m_first = lodSpan.m_first;
+        span.m_count = lodSpan.m_count;
+        span.m_min = lo;
+        span.m_max = hi;
+        span.m_center = (lo + hi) * 0.5f;
+        span.m_radius = (lo.x() <= hi.x()) ? (hi - lo).length() * 0.5f : 0.0f;
+        data.m_spanData.push_back(span);
+        addOccluder(span, positions, indices);
+
+        // Picking reports the live drawable, not a streamed-in copy
+        PickSpan pickSpan = { spans, data.m_spanIndices[ls] };
+        TriangleBVH::TagRange range = {
+            lodSpan.m_first, lodSpan.m_count, static_cast<unsigned int>(m_pickSpans.size())
+        };
+        m_pickSpans.push_back(pickSpan);
+        pickMesh.m_tags.push_back(range);
+    }
+    m_pickMeshes.push_back(std::move(pickMesh));
+}
+
+size_t PlasmaGLWidget::dedupSpans(RenderData *render, unsigned int format,
+                                  const BufferData &data, std::vector<bool> &keep)
+{
+    const size_t stride = render->m_layout.m_stride;
+    keep.assign(data.m_spans.size(), true);
+    size_t kept = 0;
+    for (size_t ls = 0; ls < data.m_spans.size(); ++ls) {
+        // Only whole icicles, whose indices stay inside their own vertices
+        const LodSpan &span = data.m_spans[ls];
+        const LodSpan &vertices = data.m_vertexRanges[ls];
+        std::vector<unsigned short> local;
+        if (data.m_spanIndices[ls] != UINT_MAX
+                && vertices.m_first + vertices.m_count <= data.m_vertexCount) {
+            local.reserve(span.m_count);
+            for (unsigned int i = span.m_first; i < span.m_first + span.m_count; ++i) {
+                unsigned short idx = data.m_indices[i];
+                if (idx < vertices.m_first || idx >= vertices.m_first + vertices.m_count)
+                    break;
+                local.push_back(static_cast<unsigned short>(idx - vertices.m_first));
+            }
+        }
+        if (local.empty() || local.size() != span.m_count) {
+            ++kept;
+            continue;
+        }
+
+        GeometryDedup::Mesh mesh = {
+            data.m_vertices + vertices.m_first * stride, vertices.m_count, stride,
+            render->m_layout.m_normalOffset, format, local.data(), local.size()
+        };
+        GeometryDedup::Match match;
+        if (m_dedup.find(mesh, match)) {
+            InstanceData instance;
+            instance.m_span = m_dedupOwners[match.m_id].second;
+            instance.m_transform = match.m_transform;
+            instance.m_bounds = data.m_spanData[ls];
+            m_dedupOwners[match.m_id].first->m_instances.push_back(instance);
+            keep[ls] = false;
+            continue;
+        }
+        if (m_dedup.add(mesh) >= 0)
+            m_dedupOwners.push_back(std::make_pair(render, kept));
+        ++kept;
+    }
+    return kept;
+}
+
+void PlasmaGLWidget::compactBuffer(size_t stride, const std::vector<bool> &keep,
+                                   BufferData &data)
+{
+    // Only keep the vertices the remaining spans still use
+    std::vector<int> remap(data.m_vertexCount, -1);
+    std::vector<unsigned char> vertices;
+    std::vector<float> positions;
+    std::vector<unsigned short> indices;
+    std::vector<LodSpan> spans;
+    std::vector<SpanData> spanData;
+    size_t vertexCount = 0;
+    for (size_t ls = 0; ls < data.m_spans.size(); ++ls) {
+        if (!keep[ls])
+            continue;
+        const LodSpan &span = data.m_spans[ls];
+        LodSpan range(static_cast<unsigned int>(indices.size()), span.m_count);
+        for (unsigned int i = span.m_first; i < span.m_first + span.m_count; ++i) {
+            const unsigned short idx = data.m_indices[i];
+            if (idx >= data.m_vertexCount) {
+                indices.push_back(0);
+                continue;
+            }
+            int &mapped = remap[idx];
+            if (mapped < 0) {
+                mapped = static_cast<int>(vertexCount++);
+                const unsigned char *vert = data.m_vertices + idx * stride;
+                vertices.insert(vertices.end(), vert, vert + stride);
+                positions.insert(positions.end(), &data.m_positions[idx * 3],
+                                 &data.m_positions[idx * 3] + 3);
+            }
+            indices.push_back(static_cast<unsigned short>(mapped));
+        }
+        spans.push_back(range);
+        SpanData bounds = data.m_spanData[ls];
+        bounds.m_first = range.m_first;
+        spanData.push_back(bounds);
+    }
+
+    data.m_compacted.swap(vertices);
+    data.m_vertices = data.m_compacted.data();
+    data.m_vertexCount = vertexCount;
+    data.m_positions.swap(positions);
+    data.m_indices.swap(indices);
+    data.m_spans.swap(spans);
+    data.m_spanData.swap(spanData);
+    data.m_spanIndices.clear();
+    data.m_vertexRanges.clear();
 }
 
 void PlasmaGLWidget::setRenderMode(RenderMode mode)
@@ -96,6 +379,36 @@ void PlasmaGLWidget::setRenderMode(RenderMode mode)
     updateGL();
 }
 
+void PlasmaGLWidget::lodsReady()
+{
+    makeCurrent();
+
+    bool uploaded = false;
+    foreach (RenderData *render, m_drawables) {
+        if (!render->m_lods || !render->m_lods->m_ready || !render->m_lodBuffers.isEmpty())
+            continue;
+
+        // Once uploaded, drawing only needs each level's span ranges
+        render->m_vao.bind();
+        for (LodLevel &level : render->m_lods->m_levels) {
+            QOpenGLBuffer buffer(QOpenGLBuffer::IndexBuffer);
+            buffer.create();
+            buffer.bind();
+            buffer.setUsagePattern(QOpenGLBuffer::StaticDraw);
+            buffer.allocate(level.m_indices.data(),
+                            level.m_indices.size() * sizeof(GLushort));
+            render->m_lodBuffers.append(buffer);
+            std::vector<unsigned short>().swap(level.m_indices);
+        }
+        render->m_iBuffer.bind();
+        render->m_vao.release();
+        uploaded = true;
+    }
+
+    if (uploaded)
+        updateGL();
+}
+
 void PlasmaGLWidget::initializeGL()
 {
     glf.initializeOpenGLFunctions();
@@ -107,6 +420,8 @@ void PlasmaGLWidget::initializeGL()
         QMessageBox::warning(this, "Error compiling vshader.glsl", m_shader.log());
     if (!m_shader.addShaderFromSourceFile(QOpenGLShader::Fragment, ":/shaders/fshader.glsl"))
         QMessageBox::warning(this, "Error compiling fshader.glsl", m_shader.log());
+    // a_position has to be at 0; a_model is often a disabled array
+    m_shader.bindAttributeLocation("a_position", 0);
     if (!m_shader.link())
         return;
     if (!m_shader.bind())
@@ -116,10 +431,41 @@ void PlasmaGLWidget::initializeGL()
     sha_position = m_shader.attributeLocation("a_position");
     sha_color = m_shader.attributeLocation("a_color");
     shu_view = m_shader.uniformLocation("u_view");
+    sha_model = m_shader.attributeLocation("a_model");
+    setModelConstant(QMatrix4x4());
+
+#if !defined(QT_OPENGL_ES_2)
+    // Instanced arrays are core from 3.3, but most 3.2 drivers have the ARB
+    // extension.  Without either, instances are drawn one at a time.
+    QOpenGLContext *ctx = context()->contextHandle();
+    m_vertexAttribDivisor = nullptr;
+    if (ctx->format().version() >= qMakePair(3, 3))
+        m_vertexAttribDivisor = ctx->getProcAddress("glVertexAttribDivisor");
+    else if (ctx->hasExtension("GL_ARB_instanced_arrays"))
+        m_vertexAttribDivisor = ctx->getProcAddress("glVertexAttribDivisorARB");
+#endif
+    m_instanceBuffer = QOpenGLBuffer(QOpenGLBuffer::VertexBuffer);
+    m_instanceBuffer.create();
+    m_instanceBuffer.setUsagePattern(QOpenGLBuffer::StreamDraw);
 
     // Starting view position
     updateViewMatrix();
 
+    // If we lost our previous context, the old buffers went with it
+    if (!m_drawables.isEmpty()) {
+        foreach (RenderData *render, m_drawables)
+            delete render;
+        m_drawables.clear();
+        m_occluders.clear();
+        m_pickSpans.clear();
+        m_pickMeshes.clear();
+        m_pickTrees.clear();
+        resetDedup();
+        foreach (plDrawableSpans *spans, m_sources)
+            uploadGeometry(spans);
+        finishPage();
+    }
+
     qDebug("OpenGL initialized version: %s; GLSL: %s",
         glGetString(GL_VERSION), glGetString(GL_SHADING_LANGUAGE_VERSION));
 }
@@ -130,8 +476,13 @@ void PlasmaGLWidget::resizeGL(int w, int h)
 
     float aspect = float(w) / float(h ? h : 1);
     QMatrix4x4 projection;
-    projection.perspective(45.0f, aspect, 1.0f, 20000.0f);
+    projection.perspective(s_fovY, aspect, 1.0f, 20000.0f);
+
+    // Converts a span's radius / distance into an approximate pixel size
+    m_lodScale = (h * 0.5f) / qTan(s_fovY * 0.5f * s_degPerRad);
     m_shader.setUniformValue("u_projection", projection);
+    m_projection = projection;
+    startCulling();
 }
 
 void PlasmaGLWidget::paintGL()
@@ -142,57 +493,419 @@ void PlasmaGLWidget::paintGL()
     glPolygonMode(GL_FRONT_AND_BACK, (m_renderMode == RenderWireframe) ? GL_LINE : GL_FILL);
 #endif
 
+    if (!m_pickMeshes.empty())
+        startPickBuild();
+
+    // Normally already running since the view last changed.  Repaints that
+    // don't move the view (new LODs, expose events) reuse the last results.
+    // Wireframe is for seeing through walls, so nothing is occluded there;
+    // an empty result list draws every box.
+    const bool culling = (m_renderMode != RenderWireframe);
+    if (culling && (m_cullDirty || !m_cullStarted))
+        startCulling();
+    const std::vector<unsigned char> noResults;
+    const std::vector<unsigned char> &visible = culling ? m_culler.results() : noResults;
+    OcclusionCuller::Stats stats;
+    if (culling)
+        stats = m_culler.stats();
+    emit cullingStats(stats.m_tested, stats.m_rejected);
+
+    m_drawCalls = 0;
+    m_drawsSaved = 0;
+    size_t box = 0;
     foreach (RenderData *render, m_drawables) {
         render->m_vao.bind();
         render->m_vBuffer.bind();
         render->m_iBuffer.bind();
 
-        uintptr_t offset = 0;
+        const VertexLayout &layout = render->m_layout;
         m_shader.enableAttributeArray(sha_position);
-        glf.glVertexAttribPointer(sha_position, 3, GL_FLOAT, GL_FALSE, render->m_stride,
-                                  reinterpret_cast<GLvoid *>(offset));
-        offset += 3 * sizeof(float);
-
-        if (render->m_weights > 0) {
-            // Skip weights and skin indices
-            offset += sizeof(float) * render->m_weights;
-            if (render->m_skinIndices)
-                offset += sizeof(int);
+        glf.glVertexAttribPointer(sha_position, 3, GL_FLOAT, GL_FALSE, GLsizei(layout.m_stride),
+                                  nullptr);
+
+        m_shader.enableAttributeArray(sha_color);
+        glf.glVertexAttribPointer(sha_color, 4, GL_UNSIGNED_BYTE, GL_TRUE, GLsizei(layout.m_stride),
+                                  reinterpret_cast<GLvoid *>(layout.m_colorOffset));
+
+        // Drop occluded spans, and pick a level of detail for the rest
+        // from their size on screen
+        const int maxLevel = render->m_lodBuffers.size();
+        std::vector<int> levels(render->m_spans.size(), 0);
+        bool allFull = true;
+        for (size_t s = 0; s < render->m_spans.size(); ++s, ++box) {
+            if (box < visible.size() && !visible[box])
+                levels[s] = -1;
+            else if (maxLevel > 0)
+                levels[s] = qMin(selectLod(render->m_spans[s]), maxLevel);
+            if (levels[s] != 0)
+                allFull = false;
         }
 
-        // Normals
-        offset += 3 * sizeof(float);
+        if (allFull) {
+            drawIndexed(0, render->m_indexCount);
+        } else {
+            // Spans sit in buffer order at every level, so neighbours
+            // drawn at the same level go out as one range
+            for (int lvl = 0; lvl <= maxLevel; ++lvl) {
+                bool bound = false;
+                GLsizei runFirst = 0, runEnd = 0;
+                for (size_t s = 0; s < render->m_spans.size(); ++s) {
+                    if (levels[s] != lvl)
+                        continue;
+                    GLsizei first, count;
+                    spanRange(render, lvl, s, first, count);
+                    if (bound && first == runEnd) {
+                        runEnd += count;
+                        continue;
+                    }
 
-        // Color
-        m_shader.enableAttributeArray(sha_color);
-        glf.glVertexAttribPointer(sha_color, 4, GL_UNSIGNED_BYTE, GL_TRUE,
-                                  render->m_stride, reinterpret_cast<GLvoid *>(offset));
-        offset += sizeof(unsigned int);
+                    if (!bound) {
+                        if (lvl == 0)
+                            render->m_iBuffer.bind();
+                        else
+                            render->m_lodBuffers[lvl - 1].bind();
+                        bound = true;
+                    } else {
+                        drawIndexed(runFirst, runEnd - runFirst);
+                    }
+                    runFirst = first;
+                    runEnd = first + count;
+                }
+                if (bound)
+                    drawIndexed(runFirst, runEnd - runFirst);
+            }
+        }
+
+        if (!render->m_instances.empty())
+            drawInstances(render, visible, box);
+    }
+    emit drawStats(m_drawCalls, m_drawsSaved);
+}
+
+void PlasmaGLWidget::drawInstances(RenderData *render, const std::vector<unsigned char> &visible,
+                                   size_t &box)
+{
+    struct InstanceDraw
+    {
+        int m_level;
+        size_t m_span;
+        size_t m_instance;
+    };
+
+    // Group the visible instances by level and span; each group is one draw
+    const int maxLevel = render->m_lodBuffers.size();
+    std::vector<InstanceDraw> draws;
+    for (size_t i = 0; i < render->m_instances.size(); ++i, ++box) {
+        if (box < visible.size() && !visible[box])
+            continue;
+        const InstanceData &instance = render->m_instances[i];
+        int level = (maxLevel > 0) ? qMin(selectLod(instance.m_bounds), maxLevel) : 0;
+        InstanceDraw draw = { level, instance.m_span, i };
+        draws.push_back(draw);
+    }
+    if (draws.empty())
+        return;
+    std::sort(draws.begin(), draws.end(), [](const InstanceDraw &a, const InstanceDraw &b) {
+        return (a.m_level != b.m_level) ? a.m_level < b.m_level : a.m_span < b.m_span;
+    });
+
+    typedef void (QOPENGLF_APIENTRYP VertexAttribDivisorFunc)(GLuint, GLuint);
+    VertexAttribDivisorFunc vertexAttribDivisor =
+            reinterpret_cast<VertexAttribDivisorFunc>(m_vertexAttribDivisor);
+    if (vertexAttribDivisor) {
+        std::vector<GLfloat> transforms;
+        transforms.reserve(draws.size() * 16);
+        for (const InstanceDraw &draw : draws) {
+            const GLfloat *matrix = render->m_instances[draw.m_instance].m_transform.constData();
+            transforms.insert(transforms.end(), matrix, matrix + 16);
+        }
+        m_instanceBuffer.bind();
+        m_instanceBuffer.allocate(transforms.data(), transforms.size() * sizeof(GLfloat));
+    }
 
-        // Color 2?
-        offset += sizeof(unsigned int);
+    int boundLevel = -1;
+    for (size_t first = 0; first < draws.size(); ) {
+        size_t last = first + 1;
+        while (last < draws.size() && draws[last].m_level == draws[first].m_level
+                && draws[last].m_span == draws[first].m_span)
+            ++last;
 
-        for (int u = 0; u < render->m_uvws; ++u) {
-            // TODO
-            offset += 3 * sizeof(float);
+        const int level = draws[first].m_level;
+        if (level != boundLevel) {
+            if (level == 0)
+                render->m_iBuffer.bind();
+            else
+                render->m_lodBuffers[level - 1].bind();
+            boundLevel = level;
         }
 
-#if defined(QT_OPENGL_ES_2)
-        if (m_renderMode == RenderWireframe) {
-            // This is kinda slow, but it works with our triangle-based index data...
-            for (GLsizei i = 0; i < render->m_indexCount; i += 3) {
-                glDrawElements(GL_LINE_LOOP, 3, GL_UNSIGNED_SHORT,
-                               reinterpret_cast<GLvoid *>(i * sizeof(GLushort)));
+        GLsizei start, count;
+        spanRange(render, level, draws[first].m_span, start, count);
+
+#if !defined(QT_OPENGL_ES_2)
+        if (vertexAttribDivisor) {
+            // The mat4 attribute takes up four consecutive locations
+            for (int col = 0; col < 4; ++col) {
+                uintptr_t offset = (first * 16 + col * 4) * sizeof(GLfloat);
+                m_shader.enableAttributeArray(sha_model + col);
+                glf.glVertexAttribPointer(sha_model + col, 4, GL_FLOAT, GL_FALSE,
+                                          16 * sizeof(GLfloat), reinterpret_cast<GLvoid *>(offset));
+                vertexAttribDivisor(sha_model + col, 1);
             }
-        } else {
-            glDrawElements(GL_TRIANGLES, render->m_indexCount,
-                           GL_UNSIGNED_SHORT, nullptr);
+            glf.glDrawElementsInstanced(GL_TRIANGLES, count, GL_UNSIGNED_SHORT,
+                                        reinterpret_cast<GLvoid *>(start * sizeof(GLushort)),
+                                        GLsizei(last - first));
+            ++m_drawCalls;
+            m_drawsSaved += int(last - first) - 1;
+            first = last;
+            continue;
         }
-#else
-        glDrawElements(GL_TRIANGLES, render->m_indexCount,
-                       GL_UNSIGNED_SHORT, nullptr);
 #endif
+        for (size_t d = first; d < last; ++d) {
+            setModelConstant(render->m_instances[draws[d].m_instance].m_transform);
+            drawIndexed(start, count);
+        }
+        first = last;
+    }
+
+    // Everything else is drawn untransformed
+    if (vertexAttribDivisor) {
+        for (int col = 0; col < 4; ++col) {
+            vertexAttribDivisor(sha_model + col, 0);
+            m_shader.disableAttributeArray(sha_model + col);
+        }
+    }
+    setModelConstant(QMatrix4x4());
+}
+
+void PlasmaGLWidget::spanRange(const RenderData *render, int level, size_t span,
+                               GLsizei &first, GLsizei &count)
+{
+    if (level == 0) {
+        first = render->m_spans[span].m_first;
+        count = render->m_spans[span].m_count;
+    } else {
+        const LodSpan &lodSpan = render->m_lods->m_levels[level - 1].m_spans[span];
+        first = GLsizei(lodSpan.m_first);
+        count = GLsizei(lodSpan.m_count);
+    }
+}
+
+void PlasmaGLWidget::setModelConstant(const QMatrix4x4 &model)
+{
+    if (sha_model >= 0)
+        m_shader.setAttributeValue(sha_model, model.constData(), 4, 4);
+}
+
+void PlasmaGLWidget::finishPage()
+{
+    // The stats stay; only the lookup data goes
+    m_dedup.clear();
+    m_dedupOwners.clear();
+}
+
+size_t PlasmaGLWidget::residentBytes() const
+{
+    size_t bytes = m_dedup.residentBytes();
+    for (const TriangleBVH::Mesh &mesh : m_pickMeshes) {
+        bytes += mesh.m_positions.size() * sizeof(float)
+               + mesh.m_indices.size() * sizeof(unsigned short)
+               + mesh.m_tags.size() * sizeof(TriangleBVH::TagRange);
+    }
+    for (const Occluder &occluder : m_occluders)
+        bytes += occluder.m_triangles.size() * sizeof(float);
+    foreach (const std::shared_ptr<PickTree> &tree, m_pickTrees) {
+        if (tree->m_ready)
+            bytes += tree->m_bvh.residentBytes();
+    }
+    foreach (RenderData *render, m_drawables) {
+        if (!render->m_lods || !render->m_lods->m_ready)
+            continue;
+        for (const LodLevel &level : render->m_lods->m_levels)
+            bytes += level.m_indices.size() * sizeof(unsigned short);
+    }
+    return bytes;
+}
+
+void PlasmaGLWidget::resetDedup()
+{
+    m_dedup.clear();
+    m_dedupOwners.clear();
+    m_dedupBytesSaved = 0;
+}
+
+PlasmaGLWidget::InstancingStats PlasmaGLWidget::instancingStats() const
+{
+    InstancingStats stats;
+    stats.m_instances = 0;
+    foreach (RenderData *render, m_drawables)
+        stats.m_instances += int(render->m_instances.size());
+
+    // The per-instance transforms are uploaded each frame
+    stats.m_bytesSaved = m_dedupBytesSaved - qint64(stats.m_instances * 16 * sizeof(GLfloat));
+    return stats;
+}
+
+void PlasmaGLWidget::addOccluder(const SpanData &span, const std::vector<float> &positions,
+                                 const std::vector<unsigned short> &indices)
+{
+    const size_t triCount = span.m_count / 3;
+    if (triCount == 0 || triCount > s_maxOccluderTris)
+        return;
+    if (m_occluders.size() >= s_maxOccluders && span.m_radius <= m_occluders.back().m_score)
+        return;
+
+    Occluder occluder;
+    occluder.m_score = span.m_radius;
+    occluder.m_triangles.reserve(triCount * 9);
+    const size_t vertexCount = positions.size() / 3;
+    for (size_t t = 0; t < triCount; ++t) {
+        const unsigned short *tri = &indices[span.m_first + t * 3];
+        if (tri[0] >= vertexCount || tri[1] >= vertexCount || tri[2] >= vertexCount)
+            continue;
+        for (int k = 0; k < 3; ++k)
+            occluder.m_triangles.insert(occluder.m_triangles.end(),
+                                        &positions[tri[k] * 3], &positions[tri[k] * 3] + 3);
+    }
+
+    // Keep the list sorted biggest first, so the smallest falls off the end
+    auto pos = std::upper_bound(m_occluders.begin(), m_occluders.end(), occluder,
+                                [](const Occluder &a, const Occluder &b) {
+                                    return a.m_score > b.m_score;
+                                });
+    m_occluders.insert(pos, std::move(occluder));
+    if (m_occluders.size() > s_maxOccluders)
+        m_occluders.pop_back();
+}
+
+void PlasmaGLWidget::startCulling()
+{
+    if (m_renderMode == RenderWireframe) {
+        m_cullStarted = false;
+        return;
+    }
+
+    if (m_cullDirty) {
+        std::vector<float> triangles;
+        for (const Occluder &occluder : m_occluders)
+            triangles.insert(triangles.end(), occluder.m_triangles.begin(),
+                             occluder.m_triangles.end());
+        m_culler.setOccluders(triangles);
+
+        std::vector<OcclusionCuller::Box> boxes;
+        foreach (RenderData *render, m_drawables) {
+            for (const SpanData &span : render->m_spans) {
+                OcclusionCuller::Box box = {
+                    { span.m_min.x(), span.m_min.y(), span.m_min.z() },
+                    { span.m_max.x(), span.m_max.y(), span.m_max.z() }
+                };
+                boxes.push_back(box);
+            }
+            for (const InstanceData &instance : render->m_instances) {
+                const SpanData &span = instance.m_bounds;
+                OcclusionCuller::Box box = {
+                    { span.m_min.x(), span.m_min.y(), span.m_min.z() },
+                    { span.m_max.x(), span.m_max.y(), span.m_max.z() }
+                };
+                boxes.push_back(box);
+            }
+        }
+        m_culler.setBoxes(boxes);
+        m_cullDirty = false;
+    }
+
+    m_culler.beginFrame(m_projection * m_view);
+    m_cullStarted = true;
+}
+
+void PlasmaGLWidget::startPickBuild()
+{
+    // Each batch of new geometry gets its own tree, built in the background
+    // alongside the LODs so the UI keeps its core
+    std::shared_ptr<PickTree> tree = std::make_shared<PickTree>();
+    std::shared_ptr<std::vector<TriangleBVH::Mesh> > meshes =
+            std::make_shared<std::vector<TriangleBVH::Mesh> >();
+    meshes->swap(m_pickMeshes);
+    m_pickTrees.append(tree);
+
+    m_lodPool.start(new FunctionJob([tree, meshes]() {
+        tree->m_bvh.build(std::move(*meshes));
+        tree->m_ready = true;
+    }));
+}
+
+void PlasmaGLWidget::pick(const QPoint &pos)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    // Unproject the cursor onto the near and far planes
+    QMatrix4x4 inverse = (m_projection * m_view).inverted();
+    float nx = 2.0f * pos.x() / qMax(width(), 1) - 1.0f;
+    float ny = 1.0f - 2.0f * pos.y() / qMax(height(), 1);
+    QVector4D nearPt = inverse * QVector4D(nx, ny, -1.0f, 1.0f);
+    QVector4D farPt = inverse * QVector4D(nx, ny, 1.0f, 1.0f);
+    QVector3D origin = nearPt.toVector3DAffine();
+    QVector3D direction = (farPt.toVector3DAffine() - origin).normalized();
+
+    const float rayOrigin[3] = { origin.x(), origin.y(), origin.z() };
+    const float rayDir[3] = { direction.x(), direction.y(), direction.z() };
+    bool found = false, pending = false;
+    TriangleBVH::Hit best;
+    foreach (const std::shared_ptr<PickTree> &tree, m_pickTrees) {
+        if (!tree->m_ready) {
+            pending = true;
+            continue;
+        }
+        TriangleBVH::Hit hit;
+        if (tree->m_bvh.intersect(rayOrigin, rayDir, hit)
+                && (!found || hit.m_distance < best.m_distance)) {
+            best = hit;
+            found = true;
+        }
+    }
+
+    double msecs = timer.nsecsElapsed() / 1000000.0;
+    if (found && best.m_tag < m_pickSpans.size()) {
+        const PickSpan &span = m_pickSpans[best.m_tag];
+        emit spanPicked(span.m_drawable, span.m_span, msecs);
+    } else if (pending) {
+        emit pickPending();
+    }
+}
+
+int PlasmaGLWidget::selectLod(const SpanData &span) const
+{
+    float dist = (span.m_center - m_position).length();
+    if (dist <= span.m_radius)
+        return 0;
+
+    float pixels = span.m_radius * m_lodScale / dist;
+    if (pixels >= 128.0f)
+        return 0;
+    if (pixels >= 48.0f)
+        return 1;
+    if (pixels >= 16.0f)
+        return 2;
+    return 3;
+}
+
+void PlasmaGLWidget::drawIndexed(GLsizei first, GLsizei count)
+{
+#if defined(QT_OPENGL_ES_2)
+    if (m_renderMode == RenderWireframe) {
+        // This is kinda slow, but it works with our triangle-based index data...
+        for (GLsizei i = first; i < first + count; i += 3) {
+            glDrawElements(GL_LINE_LOOP, 3, GL_UNSIGNED_SHORT,
+                           reinterpret_cast<GLvoid *>(i * sizeof(GLushort)));
+            ++m_drawCalls;
+        }
+        return;
     }
+#endif
+    glDrawElements(GL_TRIANGLES, count, GL_UNSIGNED_SHORT,
+                   reinterpret_cast<GLvoid *>(first * sizeof(GLushort)));
+    ++m_drawCalls;
 }
 
 void PlasmaGLWidget::keyPressEvent(QKeyEvent *event)
@@ -246,16 +959,26 @@ void PlasmaGLWidget::keyPressEvent(QKeyEvent *event)
 void PlasmaGLWidget::mousePressEvent(QMouseEvent *event)
 {
     m_mousePos = event->pos();
+    m_pressPos = event->pos();
+    m_dragged = false;
     setCursor(QCursor(Qt::BlankCursor));
 }
 
-void PlasmaGLWidget::mouseReleaseEvent(QMouseEvent *)
+void PlasmaGLWidget::mouseReleaseEvent(QMouseEvent *event)
 {
     setCursor(QCursor(Qt::ArrowCursor));
+
+    // A left click that didn't turn into a drag picks what's under it
+    if (event->button() == Qt::LeftButton && event->buttons() == Qt::NoButton && !m_dragged)
+        pick(event->pos());
 }
 
 void PlasmaGLWidget::mouseMoveEvent(QMouseEvent *event)
 {
+    // Once the view has moved, coming back to the press point isn't a click
+    if (event->buttons() != Qt::NoButton && (event->pos() - m_pressPos).manhattanLength() >= 3)
+        m_dragged = true;
+
     if (event->buttons() == Qt::LeftButton) {
         // Flat Movement
         float delta = (m_mousePos.y() - event->pos().y()) * .5f;
@@ -284,6 +1007,7 @@ void PlasmaGLWidget::mouseMoveEvent(QMouseEvent *event)
     if (event->buttons() != Qt::NoButton && !rect().contains(event->pos())) {
         QCursor::setPos(mapToGlobal(rect().center()));
         m_mousePos = rect().center();
+        m_dragged = true;
     } else {
         m_mousePos = event->pos();
     }
@@ -299,4 +1023,9 @@ void PlasmaGLWidget::updateViewMatrix()
     view.rotate(m_theta, 0.0f, 0.0f, 1.0f);
     view.translate(-m_position.x(), -m_position.y(), -m_position.z());
     m_shader.setUniformValue(shu_view, view);
+
+    // Get the workers culling against the new view while the GPU is still
+    // busy with the last frame
+    m_view = view;
+    startCulling();
 }
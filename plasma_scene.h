@@ -22,9 +22,20 @@
 #include <QOpenGLVertexArrayObject>
 #include <QOpenGLShaderProgram>
 #include <QVector3D>
+#include <QMatrix4x4>
 #include <QList>
+#include <QThreadPool>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "occlusion_culler.h"
+#include "triangle_bvh.h"
+#include "geometry_dedup.h"
+#include "lod_builder.h"
+#include "vertex_layout.h"
 
 class plDrawableSpans;
+class GeometryStreamer;
 
 class PlasmaGLWidget : public QGLWidget
 {
@@ -32,18 +43,44 @@ class PlasmaGLWidget : public QGLWidget
 
 public:
     PlasmaGLWidget(QWidget *parent = 0);
-    virtual ~PlasmaGLWidget() { clear(); }
+    virtual ~PlasmaGLWidget();
 
     void clear();
     void addGeometry(plDrawableSpans *spans);
+    void setStreamer(GeometryStreamer *streamer) { m_streamer = streamer; }
+
+    // What deduplication has saved since the last clear(); the draw calls
+    // it saves are reported per frame through drawStats()
+    struct InstancingStats
+    {
+        int m_instances;
+        qint64 m_bytesSaved;
+    };
+    InstancingStats instancingStats() const;
+
+    // Call once a page's geometry has all been added; drops the data only
+    // needed to find repeats within it
+    void finishPage();
+
+    // Bytes of geometry-derived data the widget itself still holds in RAM
+    size_t residentBytes() const;
 
     enum RenderMode {
         RenderWireframe, RenderFlat, RenderTextured
     };
 
+signals:
+    void cullingStats(int tested, int rejected);
+    void spanPicked(plDrawableSpans *spans, unsigned int span, double msecs);
+    void pickPending();
+    void drawStats(int draws, int instancingSaved);
+
 public slots:
     void setRenderMode(RenderMode mode);
 
+private slots:
+    void lodsReady();
+
 protected:
     virtual void initializeGL();
     virtual void resizeGL(int w, int h);
@@ -55,35 +92,140 @@ protected:
     virtual void mouseMoveEvent(QMouseEvent *event);
 
 private:
+    struct SpanData
+    {
+        GLsizei m_first, m_count;
+        QVector3D m_min, m_max;
+        QVector3D m_center;
+        float m_radius;
+    };
+
+    struct Occluder
+    {
+        float m_score;
+        std::vector<float> m_triangles;
+    };
+
+    struct PickSpan
+    {
+        plDrawableSpans *m_drawable;
+        unsigned int m_span;
+    };
+
+    struct PickTree
+    {
+        std::atomic<bool> m_ready;
+        TriangleBVH m_bvh;
+
+        PickTree() : m_ready(false) { }
+    };
+
+    // A span repeating one in another RenderData, drawn from its data
+    struct InstanceData
+    {
+        size_t m_span;
+        QMatrix4x4 m_transform;
+        SpanData m_bounds;
+    };
+
     struct RenderData
     {
         QOpenGLVertexArrayObject m_vao;
         QOpenGLBuffer m_vBuffer, m_iBuffer;
-        GLsizei m_stride;
+        VertexLayout m_layout;
         GLsizei m_indexCount;
-        int m_weights;
-        int m_uvws;
-        bool m_skinIndices;
 
-        RenderData(GLsizei stride, GLsizei indexCount, int weights,
-                   int uvws, bool skinIndices)
+        // Level 0 is m_iBuffer; the rest are filled in by a LodBuilder, whose
+        // index data is dropped once it has been uploaded
+        std::vector<SpanData> m_spans;
+        std::shared_ptr<LodSet> m_lods;
+        QList<QOpenGLBuffer> m_lodBuffers;
+
+        std::vector<InstanceData> m_instances;
+
+        RenderData(const VertexLayout &layout, GLsizei indexCount)
             : m_vBuffer(QOpenGLBuffer::VertexBuffer),
-              m_iBuffer(QOpenGLBuffer::IndexBuffer), m_stride(stride),
-              m_indexCount(indexCount), m_weights(weights), m_uvws(uvws),
-              m_skinIndices(skinIndices) { }
+              m_iBuffer(QOpenGLBuffer::IndexBuffer), m_layout(layout),
+              m_indexCount(indexCount) { }
+    };
+
+    // CPU-side working copy of one vertex/index buffer while it's uploaded
+    struct BufferData
+    {
+        const unsigned char *m_vertices;
+        size_t m_vertexCount;
+        std::vector<unsigned char> m_compacted;     // Backs m_vertices once compacted
+        std::vector<float> m_positions;
+        std::vector<unsigned short> m_indices;
+
+        // Per span, in buffer order: its indices, its icicle (or UINT_MAX),
+        // and the icicle's vertices
+        std::vector<LodSpan> m_spans;
+        std::vector<unsigned int> m_spanIndices;
+        std::vector<LodSpan> m_vertexRanges;
+        std::vector<SpanData> m_spanData;
+
+        BufferData() : m_vertices(nullptr), m_vertexCount(0) { }
     };
     QList<RenderData *> m_drawables;
+    QList<plDrawableSpans *> m_sources;
+    GeometryStreamer *m_streamer;
     QVector3D m_position;
     float m_theta, m_phi;
     QPoint m_mousePos;
     RenderMode m_renderMode;
+    float m_lodScale;
+    QThreadPool m_lodPool;
+
+    OcclusionCuller m_culler;
+    std::vector<Occluder> m_occluders;
+    QMatrix4x4 m_projection, m_view;
+    // m_cullStarted: the culler has been run against the current view
+    bool m_cullDirty, m_cullStarted;
+
+    // Buffers not yet handed to a PickTree are gathered in m_pickMeshes;
+    // their tags index m_pickSpans
+    std::vector<PickSpan> m_pickSpans;
+    std::vector<TriangleBVH::Mesh> m_pickMeshes;
+    QList<std::shared_ptr<PickTree> > m_pickTrees;
+    QPoint m_pressPos;
+    bool m_dragged;
+
+    // Spans added to m_dedup, by id, and where they ended up
+    GeometryDedup m_dedup;
+    std::vector<std::pair<RenderData *, size_t> > m_dedupOwners;
+    qint64 m_dedupBytesSaved;
+    int m_drawCalls, m_drawsSaved;     // In the last frame
+    QOpenGLBuffer m_instanceBuffer;
+    QFunctionPointer m_vertexAttribDivisor;
 
     QOpenGLShaderProgram m_shader;
     int sha_position;
     int sha_color;
+    int sha_model;
     int shu_view;
 
     void updateViewMatrix();
+    void uploadGeometry(plDrawableSpans *spans);
+    void readBuffer(plDrawableSpans *source, size_t grp, size_t buf,
+                    const RenderData *render, BufferData &data);
+    void captureSpans(plDrawableSpans *spans, BufferData &data);
+    size_t dedupSpans(RenderData *render, unsigned int format, const BufferData &data,
+                      std::vector<bool> &keep);
+    static void compactBuffer(size_t stride, const std::vector<bool> &keep, BufferData &data);
+    int selectLod(const SpanData &span) const;
+    void drawIndexed(GLsizei first, GLsizei count);
+    static void spanRange(const RenderData *render, int level, size_t span,
+                          GLsizei &first, GLsizei &count);
+    void drawInstances(RenderData *render, const std::vector<unsigned char> &visible,
+                       size_t &box);
+    void setModelConstant(const QMatrix4x4 &model);
+    void resetDedup();
+    void addOccluder(const SpanData &span, const std::vector<float> &positions,
+                     const std::vector<unsigned short> &indices);
+    void startCulling();
+    void startPickBuild();
+    void pick(const QPoint &pos);
 };
 
 #endif
@@ -0,0 +1,34 @@
+/* This file is part of PlasmaView.
+ *
+ * PlasmaView is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PlasmaView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Gneral Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PlasmaView.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PLASMA_UTIL_H
+#define _PLASMA_UTIL_H
+
+#include <QString>
+#include <string_theory/string>
+
+#define STToQString(x)  QString::fromUtf8((x).c_str())
+inline ST::string qStringToST(const QString &str)
+{
+    QByteArray utf8 = str.toUtf8();
+    return ST::string::from_utf8(utf8.constData(), utf8.size(), ST::assume_valid);
+}
+
+// Shared by the viewer and the thumbnail renderer, so both frame alike
+static const float s_degPerRad = 0.0174532925f;
+static const float s_fovY = 45.0f;
+
+#endif
@@ -26,21 +26,20 @@
 #include <QProgressDialog>
 #include <QDir>
 #include <QSettings>
+#include <QStatusBar>
+#include <QLabel>
 #include <ResManager/plResManager.h>
 #include <PRP/Object/plSceneObject.h>
+#include <PRP/Object/plDrawInterface.h>
 #include <PRP/Geometry/plDrawableSpans.h>
 #include <PRP/plSceneNode.h>
 #include "plasma_scene.h"
-
-#define STToQString(x)  QString::fromUtf8((x).c_str())
-inline ST::string qStringToST(const QString &str)
-{
-    QByteArray utf8 = str.toUtf8();
-    return ST::string::from_utf8(utf8.constData(), utf8.size(), ST::assume_valid);
-}
+#include "geometry_stream.h"
+#include "mapped_stream.h"
+#include "plasma_util.h"
 
 PlasmaView::PlasmaView()
-    : m_resMgr(0)
+    : m_resMgr(0), m_streamer(0)
 {
     setWindowTitle("Plasma Viewer");
 
@@ -60,6 +59,23 @@ PlasmaView::PlasmaView()
     m_render = new PlasmaGLWidget(this);
     setCentralWidget(m_render);
 
+    connect(m_render, &PlasmaGLWidget::spanPicked, this, &PlasmaView::pickSpan);
+    connect(m_render, &PlasmaGLWidget::pickPending, [this]() {
+        statusBar()->showMessage("Picking data is still being built; try again shortly");
+    });
+
+    QLabel *cullLabel = new QLabel(this);
+    statusBar()->addPermanentWidget(cullLabel);
+    connect(m_render, &PlasmaGLWidget::cullingStats, [cullLabel](int tested, int rejected) {
+        cullLabel->setText(QString("Occluded: %1 / %2 spans").arg(rejected).arg(tested));
+    });
+
+    QLabel *drawLabel = new QLabel(this);
+    statusBar()->addPermanentWidget(drawLabel);
+    connect(m_render, &PlasmaGLWidget::drawStats, [drawLabel](int draws, int saved) {
+        drawLabel->setText(QString("Draws: %1 (%2 saved by instancing)").arg(draws).arg(saved));
+    });
+
     QToolBar *mainTbar = addToolBar("Main Toolbar");
     QAction *aOpen = mainTbar->addAction(QIcon::fromTheme("document-open"), "&Load Age");
     aOpen->setShortcut(QKeySequence::Open);
@@ -92,11 +108,28 @@ PlasmaView::PlasmaView()
         m_render->setRenderMode(PlasmaGLWidget::RenderTextured);
     });
 
+    mainTbar->addSeparator();
+    QSettings settings("PlasmaShop", "PlasmaView");
+    m_streamGeometry = settings.value("StreamGeometry", false).toBool();
+    QAction *aStream = mainTbar->addAction("&Stream Geometry");
+    aStream->setToolTip("Drop CPU copies of geometry after uploading it to the GPU");
+    aStream->setCheckable(true);
+    aStream->setChecked(m_streamGeometry);
+    connect(aStream, &QAction::toggled, [this](bool checked) {
+        m_streamGeometry = checked;
+        if (m_streamer)
+            m_streamer->setEnabled(checked);
+        QSettings settings("PlasmaShop", "PlasmaView");
+        settings.setValue("StreamGeometry", checked);
+    });
+
     resize(800, 600);
 }
 
 PlasmaView::~PlasmaView()
 {
+    m_render->clear();
+    delete m_streamer;
     delete m_resMgr;
 }
 
@@ -116,8 +149,15 @@ void PlasmaView::onOpenAge()
 void PlasmaView::loadAge(const QString &filename)
 {
     m_objectTree->clear();
+    m_render->clear();
+    m_spanOwners.clear();
+    m_currentLocation = plLocation();
+    delete m_streamer;
     delete m_resMgr;
     m_resMgr = new plResManager;
+    m_streamer = new GeometryStreamer(m_resMgr);
+    m_streamer->setEnabled(m_streamGeometry);
+    m_render->setStreamer(m_streamer);
 
     QString ageFile = QDir::toNativeSeparators(QDir::current().absoluteFilePath(filename));
     plPageInfo *lastPage = 0;
@@ -137,9 +177,13 @@ void PlasmaView::loadAge(const QString &filename)
     progress.show();
     qApp->processEvents();
 
-    plAgeInfo *age = m_resMgr->ReadAge(ageFile.toUtf8().constData(), true);
+    plAgeInfo *age = readAgeMapped(m_resMgr, ageFile);
+    QDir ageDir = QFileInfo(ageFile).absoluteDir();
     for (size_t pg = 0; pg < age->getNumPages(); ++pg) {
         plLocation pageLoc = age->getPageLoc(pg, m_resMgr->getVer());
+        m_streamer->setPageFile(pageLoc,
+                pageFilePath(ageDir, age, pg, m_resMgr->getVer()));
+
         std::vector<plKey> keys = m_resMgr->getKeys(pageLoc, kSceneNode);
         if (keys.size() == 0)
             // No scene node here!
@@ -192,12 +236,78 @@ void PlasmaView::selectObject(QTreeWidgetItem *current, QTreeWidgetItem *)
 
     // HACK
     m_render->clear();
+    size_t bytesBefore = 0, bytesAfter = 0;
     std::vector<plKey> keys = m_resMgr->getKeys(item->location(), kDrawableSpans);
     foreach (const plKey &key, keys) {
         plDrawableSpans *spans = plDrawableSpans::Convert(key->getObj());
+        bytesBefore += GeometryStreamer::residentBytes(spans);
         m_render->addGeometry(spans);
+        bytesAfter += GeometryStreamer::residentBytes(spans);
     }
+    m_render->finishPage();
+    bytesAfter += m_render->residentBytes();
+
+    QString memReport = QString("Geometry in RAM: %1 KiB before upload, %2 KiB after")
+                        .arg(bytesBefore / 1024).arg(bytesAfter / 1024);
 
+    PlasmaGLWidget::InstancingStats instancing = m_render->instancingStats();
+    QString instanceReport = QString("%1 repeated spans instanced, saving %2 KiB of VRAM")
+                             .arg(instancing.m_instances).arg(instancing.m_bytesSaved / 1024);
+    statusBar()->showMessage(memReport + "; " + instanceReport);
+
+    mapSpanOwners(item->location());
     m_render->updateGL();
     m_currentLocation = item->location();
 }
+
+void PlasmaView::mapSpanOwners(const plLocation &loc)
+{
+    m_spanOwners.clear();
+
+    for (int i = 0; i < m_objectTree->topLevelItemCount(); ++i) {
+        PlasmaTreeWidgetItem *page = static_cast<PlasmaTreeWidgetItem *>(m_objectTree->topLevelItem(i));
+        if (!(page->location() == loc))
+            continue;
+
+        for (int j = 0; j < page->childCount(); ++j) {
+            PlasmaTreeWidgetItem *item = static_cast<PlasmaTreeWidgetItem *>(page->child(j));
+            plSceneObject *obj = item->object();
+            if (!obj || !obj->getDrawInterface().Exists())
+                continue;
+
+            plDrawInterface *draw = plDrawInterface::Convert(obj->getDrawInterface()->getObj());
+            if (!draw)
+                continue;
+            for (size_t d = 0; d < draw->getNumDrawables(); ++d) {
+                if (!draw->getDrawable(d).Exists())
+                    continue;
+                plDrawableSpans *spans = plDrawableSpans::Convert(draw->getDrawable(d)->getObj());
+                int diIndex = draw->getDrawableKey(d);
+                if (!spans || diIndex < 0 || size_t(diIndex) >= spans->getNumDIIndices())
+                    continue;
+
+                // Matrix-only entries list transform indices, not spans
+                const plDISpanIndex &spanIndex = spans->getDIIndex(diIndex);
+                if (spanIndex.fFlags & plDISpanIndex::kMatrixOnly)
+                    continue;
+                foreach (unsigned int span, spanIndex.fIndices)
+                    m_spanOwners[SpanRef(spans, span)] = item;
+            }
+        }
+    }
+}
+
+void PlasmaView::pickSpan(plDrawableSpans *spans, unsigned int span, double msecs)
+{
+    auto owner = m_spanOwners.find(SpanRef(spans, span));
+    if (owner == m_spanOwners.end()) {
+        statusBar()->showMessage(QString("Picked an unowned span (%1 ms)")
+                                 .arg(msecs, 0, 'f', 3));
+        return;
+    }
+
+    m_objectTree->setCurrentItem(owner->second);
+    m_objectTree->scrollToItem(owner->second);
+    statusBar()->showMessage(QString("Picked %1 (%2 ms)").arg(owner->second->text(0))
+                             .arg(msecs, 0, 'f', 3));
+}
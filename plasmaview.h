@@ -19,12 +19,16 @@
 
 #include <QMainWindow>
 #include <QTreeWidgetItem>
+#include <map>
 #include <PRP/KeyedObject/plLocation.h>
 
 class QTreeWidget;
 class plResManager;
 class plSceneObject;
 class PlasmaGLWidget;
+class GeometryStreamer;
+class plDrawableSpans;
+class PlasmaTreeWidgetItem;
 
 class PlasmaView : public QMainWindow
 {
@@ -39,13 +43,22 @@ public:
 private slots:
     void onOpenAge();
     void selectObject(QTreeWidgetItem *current, QTreeWidgetItem *previous);
+    void pickSpan(plDrawableSpans *spans, unsigned int span, double msecs);
 
 private:
     plResManager *m_resMgr;
+    GeometryStreamer *m_streamer;
     plLocation m_currentLocation;
+    bool m_streamGeometry;
 
     QTreeWidget *m_objectTree;
     PlasmaGLWidget *m_render;
+
+    // Which object in the tree draws each span of the current page
+    typedef std::pair<plDrawableSpans *, unsigned int> SpanRef;
+    std::map<SpanRef, PlasmaTreeWidgetItem *> m_spanOwners;
+
+    void mapSpanOwners(const plLocation &loc);
 };
 
 class PlasmaTreeWidgetItem : public QTreeWidgetItem
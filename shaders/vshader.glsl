@@ -20,6 +20,7 @@ uniform mat4 u_projection;
 uniform mat4 u_view;
 
 attribute vec4 a_position;
+attribute mat4 a_model;
 attribute vec4 a_color;
 attribute vec3 a_uvw0;
 
@@ -28,7 +29,8 @@ varying vec3 v_texcoord0;
 
 void main()
 {
-    gl_Position = u_projection * u_view * a_position;
+    // a_model is the identity, except for spans drawn as instances
+    gl_Position = u_projection * u_view * a_model * a_position;
 
     // Pass these along to the fragment shader
     v_color = a_color;
@@ -0,0 +1,441 @@
+/* This file is part of PlasmaView.
+ *
+ * PlasmaView is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PlasmaView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Gneral Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PlasmaView.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "thumbnail_batch.h"
+#include "mapped_stream.h"
+#include "plasma_util.h"
+#include "vertex_layout.h"
+
+#include <QThread>
+#include <QDir>
+#include <QSettings>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QImage>
+#include <QMatrix4x4>
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+#include <QOpenGLFramebufferObject>
+#include <QOpenGLShaderProgram>
+#include <QOpenGLVertexArrayObject>
+#include <QOpenGLBuffer>
+#include <QtCore/qmath.h>
+#include <atomic>
+#include <memory>
+#include <cstdio>
+#include <cstring>
+#include <cfloat>
+#include <algorithm>
+#include <ResManager/plResManager.h>
+#include <PRP/Geometry/plDrawableSpans.h>
+#include <PRP/Geometry/plIcicle.h>
+#include <Debug/hsExceptions.hpp>
+
+// How far past the upper quartile a span may reach and still be framed
+static const float s_framingReach = 3.0f;
+
+namespace
+{
+    struct ThumbnailJob
+    {
+        QString m_prpFile;
+        QString m_output;
+        QString m_stateKey;
+        QString m_stamp;
+        bool m_rendered;
+    };
+
+    struct DrawBatch
+    {
+        QOpenGLVertexArrayObject m_vao;
+        QOpenGLBuffer m_vBuffer, m_iBuffer;
+        GLsizei m_stride;
+        GLsizei m_indexCount;
+        uintptr_t m_colorOffset;
+
+        DrawBatch()
+            : m_vBuffer(QOpenGLBuffer::VertexBuffer),
+              m_iBuffer(QOpenGLBuffer::IndexBuffer) { }
+    };
+
+    struct SpanBounds
+    {
+        QVector3D m_min, m_max;
+    };
+
+    class ThumbnailWorker : public QThread
+    {
+    public:
+        ThumbnailWorker(QOffscreenSurface *surface, std::vector<ThumbnailJob> &jobs,
+                        std::atomic<size_t> &nextJob, const QSize &size)
+            : m_surface(surface), m_jobs(jobs), m_nextJob(nextJob), m_size(size) { }
+
+        // Renders jobs on the calling thread until the queue runs dry
+        void renderAll();
+
+    protected:
+        virtual void run() { renderAll(); }
+
+    private:
+        QOffscreenSurface *m_surface;
+        std::vector<ThumbnailJob> &m_jobs;
+        std::atomic<size_t> &m_nextJob;
+        QSize m_size;
+
+        void renderJobs(QOpenGLContext &context);
+        bool renderPage(QOpenGLFunctions *gl, QOpenGLShaderProgram &shader,
+                        QOpenGLFramebufferObject &fbo, const ThumbnailJob &job);
+    };
+}
+
+static void addSpanBounds(plDrawableSpans *spans, std::vector<SpanBounds> &bounds)
+{
+    for (size_t i = 0; i < spans->getNumSpans(); ++i) {
+        plIcicle *ice = static_cast<plIcicle *>(spans->getSpan(i));
+        if (ice->getGroupIdx() >= spans->getNumBufferGroups())
+            continue;
+        plGBufferGroup *group = spans->getBuffer(ice->getGroupIdx());
+        const size_t buf = ice->getIBufferIdx();
+        if (buf >= group->getNumIdxBuffers() || buf >= group->getNumVertBuffers()
+                || ice->getIStartIdx() + ice->getILength() > group->getIdxBufferCount(buf))
+            continue;
+
+        const unsigned char *vdata = group->getVertBufferStorage(buf);
+        const unsigned short *idata = static_cast<const unsigned short *>(
+                group->getIdxBufferStorage(buf));
+        const size_t vertexCount = group->getVertBufferSize(buf) / group->getStride();
+        QVector3D lo(FLT_MAX, FLT_MAX, FLT_MAX), hi(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+        for (size_t j = ice->getIStartIdx(); j < ice->getIStartIdx() + ice->getILength(); ++j) {
+            if (idata[j] >= vertexCount)
+                continue;
+            float pos[3];
+            memcpy(pos, vdata + idata[j] * group->getStride(), sizeof(pos));
+            lo = QVector3D(qMin(lo.x(), pos[0]), qMin(lo.y(), pos[1]), qMin(lo.z(), pos[2]));
+            hi = QVector3D(qMax(hi.x(), pos[0]), qMax(hi.y(), pos[1]), qMax(hi.z(), pos[2]));
+        }
+        if (lo.x() <= hi.x()) {
+            SpanBounds span = { lo, hi };
+            bounds.push_back(span);
+        }
+    }
+}
+
+/* Frames the camera on the spans that make up the page itself.  Sky domes
+ * and distant backdrops reach much farther from the middle of the page than
+ * anything else, so spans reaching past a few times the upper quartile are
+ * left out.
+ */
+static void frameBounds(const std::vector<SpanBounds> &bounds, QVector3D &lo, QVector3D &hi)
+{
+    lo = QVector3D(FLT_MAX, FLT_MAX, FLT_MAX);
+    hi = QVector3D(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    if (bounds.empty())
+        return;
+
+    std::vector<float> axis[3];
+    for (const SpanBounds &span : bounds) {
+        QVector3D center = (span.m_min + span.m_max) * 0.5f;
+        for (int i = 0; i < 3; ++i)
+            axis[i].push_back(center[i]);
+    }
+    QVector3D middle;
+    for (int i = 0; i < 3; ++i) {
+        std::nth_element(axis[i].begin(), axis[i].begin() + axis[i].size() / 2, axis[i].end());
+        middle[i] = axis[i][axis[i].size() / 2];
+    }
+
+    std::vector<float> reach;
+    for (const SpanBounds &span : bounds) {
+        QVector3D center = (span.m_min + span.m_max) * 0.5f;
+        reach.push_back((center - middle).length() + (span.m_max - span.m_min).length() * 0.5f);
+    }
+    std::vector<float> sorted = reach;
+    const size_t quartile = (sorted.size() - 1) * 3 / 4;
+    std::nth_element(sorted.begin(), sorted.begin() + quartile, sorted.end());
+    const float cutoff = s_framingReach * sorted[quartile];
+
+    for (size_t s = 0; s < bounds.size(); ++s) {
+        if (reach[s] > cutoff)
+            continue;
+        const SpanBounds &span = bounds[s];
+        lo = QVector3D(qMin(lo.x(), span.m_min.x()), qMin(lo.y(), span.m_min.y()),
+                       qMin(lo.z(), span.m_min.z()));
+        hi = QVector3D(qMax(hi.x(), span.m_max.x()), qMax(hi.y(), span.m_max.y()),
+                       qMax(hi.z(), span.m_max.z()));
+    }
+}
+
+void ThumbnailWorker::renderAll()
+{
+    // Each worker gets its own context, so pages render fully in parallel
+    QOpenGLContext context;
+    context.setFormat(m_surface->format());
+    if (!context.create() || !context.makeCurrent(m_surface)) {
+        fprintf(stderr, "Could not create an offscreen OpenGL context; on a machine "
+                        "without a display, try -platform eglfs with a headless EGL driver\n");
+        return;
+    }
+
+    // Everything renderJobs() creates is released while still current
+    renderJobs(context);
+    context.doneCurrent();
+}
+
+void ThumbnailWorker::renderJobs(QOpenGLContext &context)
+{
+    // a_position has to be at 0; a_model is only ever a constant here
+    QOpenGLShaderProgram shader;
+    shader.bindAttributeLocation("a_position", 0);
+    if (!shader.addShaderFromSourceFile(QOpenGLShader::Vertex, ":/shaders/vshader.glsl")
+            || !shader.addShaderFromSourceFile(QOpenGLShader::Fragment, ":/shaders/fshader.glsl")
+            || !shader.link()) {
+        fprintf(stderr, "Error compiling shaders: %s\n", qPrintable(shader.log()));
+        return;
+    }
+
+    QOpenGLFramebufferObjectFormat fboFormat;
+    fboFormat.setAttachment(QOpenGLFramebufferObject::Depth);
+    fboFormat.setSamples(4);
+    QOpenGLFramebufferObject fbo(m_size, fboFormat);
+
+    for ( ;; ) {
+        size_t idx = m_nextJob++;
+        if (idx >= m_jobs.size())
+            break;
+        m_jobs[idx].m_rendered = renderPage(context.functions(), shader, fbo, m_jobs[idx]);
+    }
+}
+
+bool ThumbnailWorker::renderPage(QOpenGLFunctions *gl, QOpenGLShaderProgram &shader,
+                                 QOpenGLFramebufferObject &fbo, const ThumbnailJob &job)
+{
+    // A fresh manager per page keeps memory flat over a long batch
+    plResManager mgr;
+    plPageInfo *page = nullptr;
+    try {
+        page = readPageMapped(&mgr, job.m_prpFile);
+    } catch (const hsException &ex) {
+        fprintf(stderr, "Error reading %s: %s\n", qPrintable(job.m_prpFile), ex.what());
+        return false;
+    }
+    if (!page)
+        return false;
+
+    std::vector<std::unique_ptr<DrawBatch> > batches;
+    std::vector<SpanBounds> bounds;
+    std::vector<plKey> keys = mgr.getKeys(page->getLocation(), kDrawableSpans);
+    for (const plKey &key : keys) {
+        plDrawableSpans *spans = plDrawableSpans::Convert(key->getObj());
+        if (!spans)
+            continue;
+
+        for (size_t grp = 0; grp < spans->getNumBufferGroups(); ++grp) {
+            plGBufferGroup *group = spans->getBuffer(grp);
+            for (size_t buf = 0; buf < group->getNumVertBuffers(); ++buf) {
+                std::unique_ptr<DrawBatch> batch(new DrawBatch);
+                batch->m_stride = group->getStride();
+                batch->m_indexCount = group->getIdxBufferCount(buf);
+
+                batch->m_colorOffset = vertexLayout(group).m_colorOffset;
+
+                batch->m_vao.create();
+                batch->m_vao.bind();
+                batch->m_vBuffer.create();
+                batch->m_vBuffer.bind();
+                batch->m_vBuffer.allocate(group->getVertBufferStorage(buf),
+                                          group->getVertBufferSize(buf));
+                batch->m_iBuffer.create();
+                batch->m_iBuffer.bind();
+                batch->m_iBuffer.allocate(group->getIdxBufferStorage(buf),
+                                          batch->m_indexCount * sizeof(GLushort));
+                batch->m_vao.release();
+                batches.push_back(std::move(batch));
+            }
+        }
+        addSpanBounds(spans, bounds);
+    }
+
+    QVector3D lo, hi;
+    frameBounds(bounds, lo, hi);
+
+    QMatrix4x4 projection, view;
+    const float aspect = float(m_size.width()) / float(qMax(m_size.height(), 1));
+    if (lo.x() <= hi.x()) {
+        QVector3D center = (lo + hi) * 0.5f;
+        float radius = qMax((hi - lo).length() * 0.5f, 1.0f);
+        float dist = radius / qSin(s_fovY * 0.5f * s_degPerRad);
+        QVector3D eye = center + QVector3D(-0.5f, -0.7f, 0.5f).normalized() * dist;
+        view.lookAt(eye, center, QVector3D(0.0f, 0.0f, 1.0f));
+        projection.perspective(s_fovY, aspect, qMax(dist - radius, dist * 0.001f),
+                               dist + radius);
+    } else {
+        projection.perspective(s_fovY, aspect, 1.0f, 20000.0f);
+    }
+
+    fbo.bind();
+    gl->glViewport(0, 0, m_size.width(), m_size.height());
+    gl->glClearColor(0.0f, 1.0f, 1.0f, 1.0f);
+    gl->glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    gl->glEnable(GL_DEPTH_TEST);
+    gl->glEnable(GL_CULL_FACE);
+
+    shader.bind();
+    shader.setUniformValue("u_projection", projection);
+    shader.setUniformValue("u_view", view);
+    int sha_position = shader.attributeLocation("a_position");
+    int sha_color = shader.attributeLocation("a_color");
+    shader.setAttributeValue(shader.attributeLocation("a_model"),
+                             QMatrix4x4().constData(), 4, 4);
+
+    for (const std::unique_ptr<DrawBatch> &batch : batches) {
+        batch->m_vao.bind();
+        batch->m_vBuffer.bind();
+        batch->m_iBuffer.bind();
+        shader.enableAttributeArray(sha_position);
+        gl->glVertexAttribPointer(sha_position, 3, GL_FLOAT, GL_FALSE, batch->m_stride,
+                                  nullptr);
+        shader.enableAttributeArray(sha_color);
+        gl->glVertexAttribPointer(sha_color, 4, GL_UNSIGNED_BYTE, GL_TRUE, batch->m_stride,
+                                  reinterpret_cast<GLvoid *>(batch->m_colorOffset));
+        gl->glDrawElements(GL_TRIANGLES, batch->m_indexCount, GL_UNSIGNED_SHORT, nullptr);
+        batch->m_vao.release();
+    }
+
+    QImage image = fbo.toImage();
+    fbo.release();
+
+    QDir().mkpath(QFileInfo(job.m_output).absolutePath());
+    if (!image.save(job.m_output, "PNG")) {
+        fprintf(stderr, "Could not write %s\n", qPrintable(job.m_output));
+        return false;
+    }
+    return true;
+}
+
+int runThumbnailBatch(const QStringList &args)
+{
+    QSize size(256, 256);
+    int workers = QThread::idealThreadCount();
+    QStringList positional;
+    for (int i = 0; i < args.size(); ++i) {
+        if (args[i] == "--size" && i + 1 < args.size()) {
+            QStringList dims = args[++i].split('x');
+            if (dims.size() == 2)
+                size = QSize(dims[0].toInt(), dims[1].toInt());
+        } else if (args[i] == "--jobs" && i + 1 < args.size()) {
+            workers = args[++i].toInt();
+        } else {
+            positional << args[i];
+        }
+    }
+    if (positional.size() < 2 || size.isEmpty() || workers < 1) {
+        fprintf(stderr, "Usage: PlasmaView --thumbnails <outdir> [--size WxH] [--jobs N] "
+                        "<file.age> [...]\n");
+        return 1;
+    }
+
+    QDir outDir(positional.takeFirst());
+    outDir.mkpath(".");
+    QSettings state(outDir.absoluteFilePath("thumbnails.ini"), QSettings::IniFormat);
+
+    std::vector<ThumbnailJob> jobs;
+    int unchanged = 0;
+    foreach (const QString &ageFile, positional) {
+        plResManager mgr;
+        plAgeInfo *age = nullptr;
+        try {
+            age = mgr.ReadAge(ageFile.toUtf8().constData(), false);
+        } catch (const hsException &ex) {
+            fprintf(stderr, "Error reading %s: %s\n", qPrintable(ageFile), ex.what());
+            continue;
+        }
+
+        QDir ageDir = QFileInfo(ageFile).absoluteDir();
+        QString ageName = STToQString(age->getAgeName());
+        for (size_t pg = 0; pg < age->getNumPages(); ++pg) {
+            ThumbnailJob job;
+            job.m_prpFile = pageFilePath(ageDir, age, pg, mgr.getVer());
+            QFileInfo prpInfo(job.m_prpFile);
+            if (!prpInfo.exists()) {
+                fprintf(stderr, "Missing page %s\n", qPrintable(job.m_prpFile));
+                continue;
+            }
+
+            QString pageName = STToQString(age->getPage(pg).fName);
+            job.m_stateKey = ageName + "/" + pageName;
+            job.m_output = outDir.absoluteFilePath(job.m_stateKey + ".png");
+            job.m_stamp = QString("%1:%2:%3x%4").arg(prpInfo.size())
+                          .arg(prpInfo.lastModified().toMSecsSinceEpoch())
+                          .arg(size.width()).arg(size.height());
+            job.m_rendered = false;
+            if (QFile::exists(job.m_output) && state.value(job.m_stateKey).toString() == job.m_stamp) {
+                ++unchanged;
+                continue;
+            }
+            jobs.push_back(job);
+        }
+    }
+
+    QSurfaceFormat format;
+#if !defined(QT_OPENGL_ES_2)
+    format.setVersion(3, 2);
+    format.setProfile(QSurfaceFormat::CoreProfile);
+#endif
+
+    // Without threaded GL, everything is rendered right here instead
+    const bool threaded = QOpenGLContext::supportsThreadedOpenGL();
+    if (!threaded)
+        workers = 1;
+
+    // Offscreen surfaces have to be created on the GUI thread, even though
+    // each one is only ever made current on its worker
+    workers = qMin(workers, qMax(int(jobs.size()), 1));
+    std::vector<std::unique_ptr<QOffscreenSurface> > surfaces;
+    std::vector<std::unique_ptr<ThumbnailWorker> > threads;
+    std::atomic<size_t> nextJob(0);
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < workers; ++i) {
+        surfaces.emplace_back(new QOffscreenSurface);
+        surfaces.back()->setFormat(format);
+        surfaces.back()->create();
+        threads.emplace_back(new ThumbnailWorker(surfaces.back().get(), jobs, nextJob, size));
+        if (threaded)
+            threads.back()->start();
+        else
+            threads.back()->renderAll();
+    }
+    for (const std::unique_ptr<ThumbnailWorker> &thread : threads)
+        thread->wait();
+    double seconds = timer.nsecsElapsed() / 1.0e9;
+
+    int rendered = 0, failed = 0;
+    for (const ThumbnailJob &job : jobs) {
+        if (job.m_rendered) {
+            state.setValue(job.m_stateKey, job.m_stamp);
+            ++rendered;
+        } else {
+            ++failed;
+        }
+    }
+
+    fprintf(stdout, "Rendered %d pages (%d failed, %d unchanged) in %.2f s "
+                    "with %d workers: %.2f pages/sec\n",
+            rendered, failed, unchanged, seconds, workers,
+            seconds > 0.0 ? rendered / seconds : 0.0);
+    return failed ? 1 : 0;
+}
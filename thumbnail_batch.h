@@ -0,0 +1,32 @@
+/* This file is part of PlasmaView.
+ *
+ * PlasmaView is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PlasmaView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Gneral Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PlasmaView.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _THUMBNAIL_BATCH_H
+#define _THUMBNAIL_BATCH_H
+
+#include <QStringList>
+
+/* Headless batch mode: renders a PNG preview of every page of the given
+ * ages, each worker thread drawing into its own offscreen GL context.
+ *
+ *   PlasmaView --thumbnails <outdir> [--size WxH] [--jobs N] <file.age> [...]
+ *
+ * Pages whose PRP hasn't changed since the last run into the same output
+ * directory are skipped.  Must be called with a QGuiApplication running.
+ */
+int runThumbnailBatch(const QStringList &args);
+
+#endif
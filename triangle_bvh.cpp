@@ -0,0 +1,350 @@
+/* This file is part of PlasmaView.
+ *
+ * PlasmaView is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PlasmaView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Gneral Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PlasmaView.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "triangle_bvh.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#   include <emmintrin.h>
+#   define TRIANGLE_BVH_SSE2
+#endif
+
+static const int s_sahBins = 16;
+static const unsigned int s_maxLeafSize = 8;
+static const int s_maxDepth = 64;
+
+namespace
+{
+    struct Bounds
+    {
+        float m_min[3], m_max[3];
+
+        Bounds()
+        {
+            for (int i = 0; i < 3; ++i) {
+                m_min[i] = FLT_MAX;
+                m_max[i] = -FLT_MAX;
+            }
+        }
+
+        void grow(const float *p)
+        {
+            for (int i = 0; i < 3; ++i) {
+                m_min[i] = std::min(m_min[i], p[i]);
+                m_max[i] = std::max(m_max[i], p[i]);
+            }
+        }
+
+        void grow(const Bounds &other)
+        {
+            for (int i = 0; i < 3; ++i) {
+                m_min[i] = std::min(m_min[i], other.m_min[i]);
+                m_max[i] = std::max(m_max[i], other.m_max[i]);
+            }
+        }
+
+        float area() const
+        {
+            if (m_min[0] > m_max[0])
+                return 0.0f;
+            float dx = m_max[0] - m_min[0], dy = m_max[1] - m_min[1], dz = m_max[2] - m_min[2];
+            return 2.0f * (dx * dy + dy * dz + dz * dx);
+        }
+    };
+
+    struct BuildTask
+    {
+        unsigned int m_node, m_first, m_count;
+        int m_depth;
+    };
+}
+
+void TriangleBVH::build(std::vector<Mesh> meshes)
+{
+    m_nodes.clear();
+    m_meshes.swap(meshes);
+    m_triangles.clear();
+
+    for (size_t m = 0; m < m_meshes.size(); ++m) {
+        const Mesh &mesh = m_meshes[m];
+        const size_t vertexCount = mesh.m_positions.size() / 3;
+        for (const TagRange &range : mesh.m_tags) {
+            const size_t end = std::min(size_t(range.m_first) + range.m_count, mesh.m_indices.size());
+            for (size_t i = range.m_first; i + 3 <= end; i += 3) {
+                if (mesh.m_indices[i] >= vertexCount || mesh.m_indices[i + 1] >= vertexCount
+                        || mesh.m_indices[i + 2] >= vertexCount)
+                    continue;
+                TriangleRef tri = { static_cast<unsigned int>(m), static_cast<unsigned int>(i) };
+                m_triangles.push_back(tri);
+            }
+        }
+    }
+    const size_t triCount = m_triangles.size();
+    if (triCount == 0)
+        return;
+
+    std::vector<Bounds> triBounds(triCount);
+    std::vector<float> centroids(triCount * 3);
+    for (size_t t = 0; t < triCount; ++t) {
+        for (int k = 0; k < 3; ++k)
+            triBounds[t].grow(vertex(m_triangles[t], k));
+        for (int i = 0; i < 3; ++i)
+            centroids[t * 3 + i] = (triBounds[t].m_min[i] + triBounds[t].m_max[i]) * 0.5f;
+    }
+
+    std::vector<unsigned int> order(triCount);
+    for (size_t t = 0; t < triCount; ++t)
+        order[t] = static_cast<unsigned int>(t);
+
+    m_nodes.reserve(triCount * 2);
+    m_nodes.push_back(Node());
+    std::vector<BuildTask> stack;
+    BuildTask root = { 0, 0, static_cast<unsigned int>(triCount), 0 };
+    stack.push_back(root);
+
+    while (!stack.empty()) {
+        BuildTask task = stack.back();
+        stack.pop_back();
+
+        Bounds bounds, centroidBounds;
+        for (unsigned int i = task.m_first; i < task.m_first + task.m_count; ++i) {
+            bounds.grow(triBounds[order[i]]);
+            centroidBounds.grow(&centroids[order[i] * 3]);
+        }
+        Node &node = m_nodes[task.m_node];
+        for (int i = 0; i < 3; ++i) {
+            node.m_min[i] = bounds.m_min[i];
+            node.m_max[i] = bounds.m_max[i];
+        }
+        node.m_first = task.m_first;
+        node.m_count = task.m_count;
+        if (task.m_count <= 1 || task.m_depth >= s_maxDepth - 1)
+            continue;
+
+        // Binned SAH: try every bin boundary on every axis
+        int bestAxis = -1, bestSplit = 0;
+        float bestCost = FLT_MAX;
+        for (int axis = 0; axis < 3; ++axis) {
+            float lo = centroidBounds.m_min[axis], hi = centroidBounds.m_max[axis];
+            if (hi <= lo)
+                continue;
+            float scale = s_sahBins / (hi - lo);
+
+            Bounds binBounds[s_sahBins];
+            unsigned int binCounts[s_sahBins] = { 0 };
+            for (unsigned int i = task.m_first; i < task.m_first + task.m_count; ++i) {
+                int bin = std::min(s_sahBins - 1, int((centroids[order[i] * 3 + axis] - lo) * scale));
+                binCounts[bin]++;
+                binBounds[bin].grow(triBounds[order[i]]);
+            }
+
+            float rightArea[s_sahBins];
+            unsigned int rightCount[s_sahBins];
+            Bounds accum;
+            unsigned int count = 0;
+            for (int b = s_sahBins - 1; b > 0; --b) {
+                accum.grow(binBounds[b]);
+                count += binCounts[b];
+                rightArea[b] = accum.area();
+                rightCount[b] = count;
+            }
+
+            accum = Bounds();
+            count = 0;
+            for (int b = 0; b < s_sahBins - 1; ++b) {
+                accum.grow(binBounds[b]);
+                count += binCounts[b];
+                float cost = accum.area() * count + rightArea[b + 1] * rightCount[b + 1];
+                if (count > 0 && rightCount[b + 1] > 0 && cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestSplit = b + 1;
+                }
+            }
+        }
+
+        // Compare against just intersecting everything here (unit costs
+        // for traversal and intersection)
+        float leafCost = float(task.m_count);
+        float splitCost = 1.0f + bestCost / std::max(bounds.area(), FLT_MIN);
+        if (bestAxis < 0 || (splitCost >= leafCost && task.m_count <= s_maxLeafSize))
+            continue;
+
+        float lo = centroidBounds.m_min[bestAxis];
+        float scale = s_sahBins / (centroidBounds.m_max[bestAxis] - lo);
+        unsigned int *mid = std::partition(&order[task.m_first], &order[task.m_first] + task.m_count,
+                [&](unsigned int t) {
+                    int bin = std::min(s_sahBins - 1, int((centroids[t * 3 + bestAxis] - lo) * scale));
+                    return bin < bestSplit;
+                });
+        unsigned int leftCount = static_cast<unsigned int>(mid - &order[task.m_first]);
+        if (leftCount == 0 || leftCount == task.m_count)
+            continue;
+
+        unsigned int left = static_cast<unsigned int>(m_nodes.size());
+        m_nodes[task.m_node].m_first = left;
+        m_nodes[task.m_node].m_count = 0;
+        m_nodes.push_back(Node());
+        m_nodes.push_back(Node());
+
+        BuildTask leftTask = { left, task.m_first, leftCount, task.m_depth + 1 };
+        BuildTask rightTask = { left + 1, task.m_first + leftCount,
+                                task.m_count - leftCount, task.m_depth + 1 };
+        stack.push_back(leftTask);
+        stack.push_back(rightTask);
+    }
+
+    // Put the references in leaf order, so each leaf reads one run
+    std::vector<TriangleRef> sorted(triCount);
+    for (size_t i = 0; i < triCount; ++i)
+        sorted[i] = m_triangles[order[i]];
+    m_triangles.swap(sorted);
+    m_nodes.shrink_to_fit();
+}
+
+size_t TriangleBVH::residentBytes() const
+{
+    size_t bytes = m_nodes.capacity() * sizeof(Node)
+                 + m_triangles.capacity() * sizeof(TriangleRef);
+    for (const Mesh &mesh : m_meshes) {
+        bytes += mesh.m_positions.capacity() * sizeof(float)
+               + mesh.m_indices.capacity() * sizeof(unsigned short)
+               + mesh.m_tags.capacity() * sizeof(TagRange);
+    }
+    return bytes;
+}
+
+bool TriangleBVH::intersect(const float *origin, const float *direction, Hit &hit) const
+{
+    if (m_nodes.empty())
+        return false;
+
+    float invDir[3];
+    for (int i = 0; i < 3; ++i)
+        invDir[i] = 1.0f / direction[i];
+
+#if defined(TRIANGLE_BVH_SSE2)
+    const __m128 rayOrigin = _mm_set_ps(0.0f, origin[2], origin[1], origin[0]);
+    const __m128 rayInvDir = _mm_set_ps(0.0f, invDir[2], invDir[1], invDir[0]);
+    const __m128 xyzMask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+#endif
+
+    // Slab test; returns the entry distance, or FLT_MAX on a miss
+    auto enterBox = [&](const Node &node, float tMax) -> float {
+#if defined(TRIANGLE_BVH_SSE2)
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.m_min), rayOrigin), rayInvDir);
+        __m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.m_max), rayOrigin), rayInvDir);
+        // The fourth lane holds the node's index fields; replace it with
+        // the ray's [0, tMax] interval before reducing.
+        __m128 tNear = _mm_or_ps(_mm_and_ps(xyzMask, _mm_min_ps(t1, t2)),
+                                 _mm_andnot_ps(xyzMask, _mm_setzero_ps()));
+        __m128 tFar = _mm_or_ps(_mm_and_ps(xyzMask, _mm_max_ps(t1, t2)),
+                                _mm_andnot_ps(xyzMask, _mm_set1_ps(tMax)));
+        tNear = _mm_max_ps(tNear, _mm_shuffle_ps(tNear, tNear, _MM_SHUFFLE(2, 3, 0, 1)));
+        tNear = _mm_max_ps(tNear, _mm_shuffle_ps(tNear, tNear, _MM_SHUFFLE(1, 0, 3, 2)));
+        tFar = _mm_min_ps(tFar, _mm_shuffle_ps(tFar, tFar, _MM_SHUFFLE(2, 3, 0, 1)));
+        tFar = _mm_min_ps(tFar, _mm_shuffle_ps(tFar, tFar, _MM_SHUFFLE(1, 0, 3, 2)));
+        float enter = _mm_cvtss_f32(tNear);
+        return (enter <= _mm_cvtss_f32(tFar)) ? enter : FLT_MAX;
+#else
+        float enter = 0.0f, exit = tMax;
+        for (int i = 0; i < 3; ++i) {
+            float t1 = (node.m_min[i] - origin[i]) * invDir[i];
+            float t2 = (node.m_max[i] - origin[i]) * invDir[i];
+            enter = std::max(enter, std::min(t1, t2));
+            exit = std::min(exit, std::max(t1, t2));
+        }
+        return (enter <= exit) ? enter : FLT_MAX;
+#endif
+    };
+
+    const TriangleRef *bestTri = nullptr;
+    float best = FLT_MAX;
+    unsigned int stack[s_maxDepth * 2];
+    int depth = 0;
+    stack[depth++] = 0;
+
+    while (depth > 0) {
+        const Node &node = m_nodes[stack[--depth]];
+        if (enterBox(node, best) == FLT_MAX)
+            continue;
+
+        if (node.m_count == 0) {
+            // Visit the nearer child first, so its hits prune the other
+            float tLeft = enterBox(m_nodes[node.m_first], best);
+            float tRight = enterBox(m_nodes[node.m_first + 1], best);
+            unsigned int nearChild = node.m_first, farChild = node.m_first + 1;
+            if (tRight < tLeft) {
+                std::swap(nearChild, farChild);
+                std::swap(tLeft, tRight);
+            }
+            if (tRight != FLT_MAX)
+                stack[depth++] = farChild;
+            if (tLeft != FLT_MAX)
+                stack[depth++] = nearChild;
+            continue;
+        }
+
+        for (unsigned int t = node.m_first; t < node.m_first + node.m_count; ++t) {
+            // Moller-Trumbore, culling back faces like the renderer does
+            const TriangleRef &tri = m_triangles[t];
+            const float *v0 = vertex(tri, 0), *v1 = vertex(tri, 1), *v2 = vertex(tri, 2);
+            float e1[3], e2[3], s[3], p[3], q[3];
+            for (int i = 0; i < 3; ++i) {
+                e1[i] = v1[i] - v0[i];
+                e2[i] = v2[i] - v0[i];
+                s[i] = origin[i] - v0[i];
+            }
+            p[0] = direction[1] * e2[2] - direction[2] * e2[1];
+            p[1] = direction[2] * e2[0] - direction[0] * e2[2];
+            p[2] = direction[0] * e2[1] - direction[1] * e2[0];
+            float det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+            if (det <= 1.0e-12f)
+                continue;
+
+            float invDet = 1.0f / det;
+            float u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * invDet;
+            if (u < 0.0f || u > 1.0f)
+                continue;
+            q[0] = s[1] * e1[2] - s[2] * e1[1];
+            q[1] = s[2] * e1[0] - s[0] * e1[2];
+            q[2] = s[0] * e1[1] - s[1] * e1[0];
+            float v = (direction[0] * q[0] + direction[1] * q[1] + direction[2] * q[2]) * invDet;
+            if (v < 0.0f || u + v > 1.0f)
+                continue;
+            float dist = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * invDet;
+            if (dist > 0.0f && dist < best) {
+                best = dist;
+                bestTri = &tri;
+            }
+        }
+    }
+    if (!bestTri)
+        return false;
+
+    // Only the winner needs its tag looked up
+    const std::vector<TagRange> &tags = m_meshes[bestTri->m_mesh].m_tags;
+    auto range = std::upper_bound(tags.begin(), tags.end(), bestTri->m_first,
+                                  [](unsigned int first, const TagRange &range) {
+                                      return first < range.m_first;
+                                  });
+    hit.m_distance = best;
+    hit.m_tag = (range != tags.begin()) ? (range - 1)->m_tag : 0;
+    return true;
+}
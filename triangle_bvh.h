@@ -0,0 +1,88 @@
+/* This file is part of PlasmaView.
+ *
+ * PlasmaView is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PlasmaView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Gneral Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PlasmaView.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TRIANGLE_BVH_H
+#define _TRIANGLE_BVH_H
+
+#include <vector>
+#include <cstddef>
+
+/* Bounding volume hierarchy over indexed triangle meshes, for ray picking.
+ * The tree is built top-down with a binned surface area heuristic, and
+ * refers to triangles by their place in the meshes rather than copying
+ * them.  Each range of a mesh's indices carries a caller-defined tag which
+ * is reported on a hit.
+ */
+class TriangleBVH
+{
+public:
+    struct Hit
+    {
+        float m_distance;
+        unsigned int m_tag;
+    };
+
+    struct TagRange
+    {
+        unsigned int m_first, m_count;  // In indices
+        unsigned int m_tag;
+    };
+
+    struct Mesh
+    {
+        std::vector<float> m_positions;         // 3 floats per vertex
+        std::vector<unsigned short> m_indices;  // 3 per triangle
+        std::vector<TagRange> m_tags;           // Sorted, non-overlapping
+    };
+
+    // Only triangles inside one of their mesh's tag ranges are included
+    void build(std::vector<Mesh> meshes);
+
+    // Nearest front-facing hit along the ray, if any
+    bool intersect(const float *origin, const float *direction, Hit &hit) const;
+
+    size_t triangleCount() const { return m_triangles.size(); }
+
+    // Bytes held by the tree and the meshes it refers to
+    size_t residentBytes() const;
+
+private:
+    struct Node
+    {
+        float m_min[3];
+        unsigned int m_first;   // First triangle, or left child if m_count == 0
+        float m_max[3];
+        unsigned int m_count;
+    };
+
+    struct TriangleRef
+    {
+        unsigned int m_mesh;
+        unsigned int m_first;   // First of its three indices
+    };
+
+    std::vector<Node> m_nodes;
+    std::vector<Mesh> m_meshes;
+    std::vector<TriangleRef> m_triangles;
+
+    const float *vertex(const TriangleRef &tri, int k) const
+    {
+        const Mesh &mesh = m_meshes[tri.m_mesh];
+        return &mesh.m_positions[mesh.m_indices[tri.m_first + k] * 3];
+    }
+};
+
+#endif
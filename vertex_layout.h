@@ -0,0 +1,51 @@
+/* This file is part of PlasmaView.
+ *
+ * PlasmaView is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PlasmaView is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Gneral Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PlasmaView.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _VERTEX_LAYOUT_H
+#define _VERTEX_LAYOUT_H
+
+#include <cstddef>
+#include <PRP/Geometry/plGBufferGroup.h>
+
+/* Byte offsets of the attributes we draw with, within one vertex of a
+ * plGBufferGroup: position, then any skin weights and indices, the normal,
+ * and the diffuse color.  Position is always at 0.
+ */
+struct VertexLayout
+{
+    size_t m_stride;
+    size_t m_normalOffset;
+    size_t m_colorOffset;
+};
+
+inline VertexLayout vertexLayout(const plGBufferGroup *group)
+{
+    const unsigned int format = group->getFormat();
+    const int weights = (format & plGBufferGroup::kSkinWeightMask) >> 4;
+
+    VertexLayout layout;
+    layout.m_stride = group->getStride();
+    layout.m_normalOffset = 3 * sizeof(float);
+    if (weights > 0) {
+        layout.m_normalOffset += sizeof(float) * weights;
+        if (format & plGBufferGroup::kSkinIndices)
+            layout.m_normalOffset += sizeof(int);
+    }
+    layout.m_colorOffset = layout.m_normalOffset + 3 * sizeof(float);
+    return layout;
+}
+
+#endif